@@ -0,0 +1,101 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sprread.h"
+#include "sprtool.h"
+
+/*
+ * Indexing throughput benchmark for sprread: opens every sprite under the
+ * given files and directories, touches each frame header and a byte of its
+ * pixels, and reports files, frames and bytes per second.
+ */
+
+static char **paths;
+static int numpaths, maxpaths;
+
+static void add_path(const char *path, const char *relative, void *arg)
+{
+    (void)relative;
+    (void)arg;
+
+    if (numpaths == maxpaths)
+    {
+        maxpaths = maxpaths ? maxpaths * 2 : 256;
+        paths = xrealloc(paths, maxpaths * sizeof(char *));
+    }
+    paths[numpaths++] = xstrdup(path);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 5;
+    int first = 1;
+
+    if (argc > 2 && !strcmp(argv[1], "-n"))
+    {
+        iterations = atoi(argv[2]);
+        first = 3;
+    }
+
+    if (first >= argc || iterations <= 0)
+    {
+        printf("Usage: %s [-n iterations] <sprite.spr|directory>...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = first; i < argc; i++)
+        walk_sprites(argv[i], add_path, NULL);
+
+    if (!numpaths)
+    {
+        fprintf(stderr, "Error: No sprites found\n");
+        return 1;
+    }
+
+    uint64_t bytes = 0, frames = 0;
+    unsigned checksum = 0;
+    int failures = 0;
+    double start = now_seconds();
+
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        for (int i = 0; i < numpaths; i++)
+        {
+            spr_file_t spr;
+            if (spr_open(&spr, paths[i]) != SPR_OK)
+            {
+                failures++;
+                continue;
+            }
+
+            for (int f = 0; f < spr.numframes; f++)
+            {
+                spr_frame_t frame = spr_frame(&spr, f);
+                checksum += frame.width + frame.height + frame.pixels[0];
+            }
+
+            bytes += spr.size;
+            frames += spr.numframes;
+            spr_close(&spr);
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    printf("sprites:    %d (%d iteration(s), %d failed open(s))\n", numpaths, iterations, failures);
+    printf("elapsed:    %.3f s\n", elapsed);
+    printf("files/s:    %.0f\n", (double)numpaths * iterations / elapsed);
+    printf("frames/s:   %.0f\n", (double)frames / elapsed);
+    printf("MB/s:       %.1f\n", bytes / elapsed / (1024.0 * 1024.0));
+    printf("checksum:   %08x\n", checksum);
+
+    for (int i = 0; i < numpaths; i++)
+        free(paths[i]);
+    free(paths);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,514 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sprread.h"
+#include "sprtool.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+/*
+ * Turns a compiled sprite back into an indexed 8-bit BMP sheet and a .qc
+ * script that sprgen compiles into the same bytes.
+ */
+
+typedef struct
+{
+    int x, y;
+} placement_t;
+
+typedef struct
+{
+    char *input;
+    char *outdir;
+} job_t;
+
+static job_t *jobs;
+static int numjobs, maxjobs;
+static int failures;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void put_le16(uint8_t *p, int v)
+{
+    p[0] = v & 255;
+    p[1] = (v >> 8) & 255;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 255;
+    p[1] = (v >> 8) & 255;
+    p[2] = (v >> 16) & 255;
+    p[3] = (v >> 24) & 255;
+}
+
+static int make_dir(const char *path)
+{
+#ifdef _WIN32
+    int result = _mkdir(path);
+#else
+    int result = mkdir(path, 0777);
+#endif
+    return result == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/* File name without directory and without a trailing .spr. */
+static char *base_name(const char *path)
+{
+    const char *name = path;
+    for (const char *p = path; *p; p++)
+    {
+        if (*p == '/' || *p == '\\')
+            name = p + 1;
+    }
+
+    char *result = xstrdup(name);
+    if (is_sprite_name(result))
+        result[strlen(result) - 4] = 0;
+    return result;
+}
+
+/* Quotes a script token when the tokenizer would otherwise split it. */
+static void print_token(FILE *f, const char *text)
+{
+    bool plain = *text != 0;
+    for (const char *p = text; *p; p++)
+    {
+        if ((unsigned char)*p <= ' ' || *p == '"')
+            plain = false;
+    }
+    fprintf(f, plain ? "%s" : "\"%s\"", text);
+}
+
+/*
+ * Prints the shortest text that atof() followed by a float conversion turns
+ * back into the same value.
+ */
+static void print_float(FILE *f, float value)
+{
+    char text[64];
+
+    for (int precision = 6; precision <= 17; precision++)
+    {
+        snprintf(text, sizeof(text), "%.*g", precision, value);
+        if ((float)atof(text) == value)
+            break;
+    }
+    fputs(text, f);
+}
+
+/*
+ * Groups store cumulative end times; sprgen rebuilds them by summing the
+ * per-frame intervals in float. Picks the interval that lands exactly on
+ * the stored end time.
+ */
+static bool group_interval(float previous, float end, float *interval)
+{
+    float d = end - previous;
+
+    if (!(d > 0.0f))
+        return false;
+
+    for (int tries = 0; tries < 64; tries++)
+    {
+        float sum = previous + d;
+        if (sum == end)
+        {
+            *interval = d;
+            return true;
+        }
+        d = sum < end ? nextafterf(d, INFINITY) : nextafterf(d, 0.0f);
+        if (!(d > 0.0f))
+            return false;
+    }
+    return false;
+}
+
+/* Shelf-packs frames in file order into a sheet about as wide as it is tall. */
+static void pack_frames(const spr_file_t *spr, placement_t *places, int *sheetwidth, int *sheetheight)
+{
+    uint64_t area = 0;
+    int widest = 0;
+
+    for (int i = 0; i < spr->numframes; i++)
+    {
+        spr_frame_t frame = spr_frame(spr, i);
+        area += (uint64_t)frame.width * frame.height;
+        if (frame.width > widest)
+            widest = frame.width;
+    }
+
+    int width = (int)ceil(sqrt((double)area));
+    if (width < widest)
+        width = widest;
+
+    int x = 0, y = 0, shelfheight = 0, usedwidth = 0;
+    for (int i = 0; i < spr->numframes; i++)
+    {
+        spr_frame_t frame = spr_frame(spr, i);
+
+        if (x + frame.width > width)
+        {
+            x = 0;
+            y += shelfheight;
+            shelfheight = 0;
+        }
+
+        places[i].x = x;
+        places[i].y = y;
+        x += frame.width;
+        if (x > usedwidth)
+            usedwidth = x;
+        if (frame.height > shelfheight)
+            shelfheight = frame.height;
+    }
+
+    *sheetwidth = usedwidth;
+    *sheetheight = y + shelfheight;
+}
+
+static bool write_sheet(const char *path, const spr_file_t *spr, const placement_t *places, int width, int height)
+{
+    size_t rowsize = ((size_t)width + 3) & ~(size_t)3;
+    size_t datasize = rowsize * height;
+    size_t offset = 14 + 40 + 256 * 4;
+    uint8_t *image = xmalloc(offset + datasize);
+
+    memset(image, 0, offset + datasize);
+    image[0] = 'B';
+    image[1] = 'M';
+    put_le32(image + 2, (uint32_t)(offset + datasize));
+    put_le32(image + 10, (uint32_t)offset);
+    put_le32(image + 14, 40);
+    put_le32(image + 18, width);
+    put_le32(image + 22, height);
+    put_le16(image + 26, 1);
+    put_le16(image + 28, 8);
+    put_le32(image + 34, (uint32_t)datasize);
+    put_le32(image + 38, 2835);
+    put_le32(image + 42, 2835);
+    put_le32(image + 46, 256);
+
+    uint8_t *palette = image + 54;
+    for (int i = 0; i < 256; i++)
+    {
+        if (spr->palette && i < spr->palettecolors)
+        {
+            palette[i * 4] = spr->palette[i * 3 + 2];
+            palette[i * 4 + 1] = spr->palette[i * 3 + 1];
+            palette[i * 4 + 2] = spr->palette[i * 3];
+        }
+        else if (!spr->palette)
+        {
+            palette[i * 4] = palette[i * 4 + 1] = palette[i * 4 + 2] = i;
+        }
+    }
+
+    uint8_t *pixels = image + offset;
+    for (int i = 0; i < spr->numframes; i++)
+    {
+        spr_frame_t frame = spr_frame(spr, i);
+        for (int y = 0; y < frame.height; y++)
+        {
+            int row = height - 1 - (places[i].y + y);
+            memcpy(pixels + (size_t)row * rowsize + places[i].x, frame.pixels + (size_t)y * frame.width, frame.width);
+        }
+    }
+
+    FILE *f = fopen(path, "wb");
+    bool ok = f && fwrite(image, 1, offset + datasize, f) == offset + datasize;
+    if (f && fclose(f))
+        ok = false;
+    free(image);
+    return ok;
+}
+
+static void print_frame(FILE *f, const spr_file_t *spr, const placement_t *places, int index, float interval)
+{
+    spr_frame_t frame = spr_frame(spr, index);
+
+    fprintf(f, "$frame %d %d %d %d ", places[index].x, places[index].y, frame.width, frame.height);
+    print_float(f, interval);
+    fprintf(f, " %d %d\n", -frame.origin[0], frame.origin[1]);
+}
+
+static const char *type_names[] = {
+    "vp_parallel_upright", "facing_upright", "vp_parallel", "oriented", "vp_parallel_oriented"};
+
+static const char *texture_names[] = {
+    "normal", "additive", "indexalpha", "alphatest"};
+
+/* Warns about anything that keeps the script from rebuilding the same bytes. */
+static void check_round_trip(const char *input, const spr_file_t *spr)
+{
+    const spr_header_t *header = &spr->header;
+    int maxs[2] = {-9999999, -9999999};
+
+    for (int i = 0; i < spr->numframes; i++)
+    {
+        spr_frame_t frame = spr_frame(spr, i);
+        if (frame.width > maxs[0])
+            maxs[0] = frame.width;
+        if (frame.height > maxs[1])
+            maxs[1] = frame.height;
+    }
+
+    float radius = sqrt(((maxs[0] >> 1) * (maxs[0] >> 1)) + ((maxs[1] >> 1) * (maxs[1] >> 1)));
+
+    if (header->version != 2)
+        fprintf(stderr, "Warning: %s: version %d sprite, sprgen writes version 2\n", input, header->version);
+    if (header->width != maxs[0] || header->height != maxs[1] || header->boundingradius != radius)
+        fprintf(stderr, "Warning: %s: header size fields differ from what sprgen derives\n", input);
+    if (spr->palette && spr->palettecolors != 256)
+        fprintf(stderr, "Warning: %s: %d color palette, sprgen always writes 256\n", input, spr->palettecolors);
+    if (header->synctype != 0 && header->synctype != 1)
+        fprintf(stderr, "Warning: %s: sync type %d cannot be expressed in a script\n", input, header->synctype);
+}
+
+static bool decompile(const char *input, const char *outdir)
+{
+    spr_file_t spr;
+    int result = spr_open(&spr, input);
+
+    if (result != SPR_OK)
+    {
+        fprintf(stderr, "Error: %s: %s\n", input, spr_strerror(result));
+        return false;
+    }
+
+    const spr_header_t *header = &spr.header;
+    if (header->type < 0 || header->type > 4 || header->texformat < 0 || header->texformat > 3)
+    {
+        fprintf(stderr, "Error: %s: unknown sprite type or texture format\n", input);
+        spr_close(&spr);
+        return false;
+    }
+
+    for (int i = 0; i < spr.numentries; i++)
+    {
+        if (spr.entries[i].type == SPR_ANGLED)
+        {
+            fprintf(stderr, "Error: %s: angled frame groups cannot be expressed in a script\n", input);
+            spr_close(&spr);
+            return false;
+        }
+    }
+
+    check_round_trip(input, &spr);
+
+    char *name = base_name(input);
+    char *sheetpath = xmalloc(strlen(outdir) + strlen(name) + 8);
+    char *scriptpath = xmalloc(strlen(outdir) + strlen(name) + 8);
+    char *sheetname = xmalloc(strlen(name) + 8);
+    sprintf(sheetpath, "%s/%s.bmp", outdir, name);
+    sprintf(scriptpath, "%s/%s.qc", outdir, name);
+    sprintf(sheetname, "%s.bmp", name);
+
+    placement_t *places = xmalloc(spr.numframes * sizeof(placement_t));
+    int sheetwidth, sheetheight;
+    pack_frames(&spr, places, &sheetwidth, &sheetheight);
+
+    bool ok = write_sheet(sheetpath, &spr, places, sheetwidth, sheetheight);
+    FILE *f = ok ? fopen(scriptpath, "w") : NULL;
+
+    if (f)
+    {
+        fprintf(f, "// decompiled from %s by sprdecomp\n", input);
+        if (!spr.palette)
+            fprintf(f, "// the sprite has no palette, compile with -no16bit\n");
+        fprintf(f, "$spritename ");
+        print_token(f, name);
+        fprintf(f, "\n$type %s\n", type_names[header->type]);
+        fprintf(f, "$texture %s\n", texture_names[header->texformat]);
+        if (header->synctype == 0)
+            fprintf(f, "$sync\n");
+        if (header->beamlength != 0.0f)
+        {
+            fprintf(f, "$beamlength ");
+            print_float(f, header->beamlength);
+            fprintf(f, "\n");
+        }
+        fprintf(f, "$load ");
+        print_token(f, sheetname);
+        fprintf(f, "\n");
+
+        for (int i = 0; i < spr.numentries; i++)
+        {
+            const spr_entry_t *entry = &spr.entries[i];
+
+            if (entry->type == SPR_SINGLE)
+            {
+                print_frame(f, &spr, places, entry->firstframe, 0.1f);
+                continue;
+            }
+
+            float previous = 0.0f;
+            fprintf(f, "$groupstart\n");
+            for (int j = 0; j < entry->numframes; j++)
+            {
+                float end = spr_group_interval(&spr, i, j);
+                float interval;
+
+                if (!group_interval(previous, end, &interval))
+                {
+                    fprintf(stderr, "Warning: %s: group %d frame %d interval cannot be reproduced exactly\n",
+                            input, i, j);
+                    interval = end > previous ? end - previous : 0.1f;
+                }
+
+                print_frame(f, &spr, places, entry->firstframe + j, interval);
+                previous = end;
+            }
+            fprintf(f, "$groupend\n");
+        }
+
+        if (fclose(f))
+            ok = false;
+    }
+    else
+    {
+        ok = false;
+    }
+
+    if (!ok)
+        fprintf(stderr, "Error: Cannot write %s output to %s\n", input, outdir);
+    else
+        printf("%s -> %s, %s (%d frame(s), %dx%d sheet)\n", input, sheetpath, scriptpath,
+               spr.numframes, sheetwidth, sheetheight);
+
+    free(places);
+    free(sheetname);
+    free(scriptpath);
+    free(sheetpath);
+    free(name);
+    spr_close(&spr);
+    return ok;
+}
+
+static void add_job(const char *input, const char *outdir)
+{
+    if (numjobs == maxjobs)
+    {
+        maxjobs = maxjobs ? maxjobs * 2 : 64;
+        jobs = xrealloc(jobs, maxjobs * sizeof(job_t));
+    }
+    jobs[numjobs].input = xstrdup(input);
+    jobs[numjobs].outdir = xstrdup(outdir);
+    numjobs++;
+}
+
+/*
+ * Queues a sprite found under the input directory, mirroring its
+ * subdirectory into the output root given as arg.
+ */
+static void queue_sprite(const char *path, const char *relative, void *arg)
+{
+    const char *outroot = arg;
+    char *outdir = xmalloc(strlen(outroot) + strlen(relative) + 2);
+
+    sprintf(outdir, "%s/%s", outroot, relative);
+    *strrchr(outdir, '/') = 0;
+
+    /* create each missing level on the way down */
+    for (char *p = outdir + strlen(outroot) + 1; *p; p++)
+    {
+        if (*p != '/')
+            continue;
+        *p = 0;
+        make_dir(outdir);
+        *p = '/';
+    }
+
+    if (make_dir(outdir) < 0)
+    {
+        fprintf(stderr, "Error: Cannot create directory %s\n", outdir);
+        failures++;
+    }
+    else
+    {
+        add_job(path, outdir);
+    }
+    free(outdir);
+}
+
+static void decompile_job(int index, void *arg)
+{
+    (void)arg;
+
+    if (!decompile(jobs[index].input, jobs[index].outdir))
+    {
+        pthread_mutex_lock(&job_lock);
+        failures++;
+        pthread_mutex_unlock(&job_lock);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 0;
+    const char *input = NULL;
+    const char *outdir = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (!input)
+        {
+            input = argv[i];
+        }
+        else if (!outdir)
+        {
+            outdir = argv[i];
+        }
+        else
+        {
+            input = NULL;
+            break;
+        }
+    }
+
+    if (!input)
+    {
+        printf("Usage: %s [-j threads] <sprite.spr|directory> [outdir]\n", argv[0]);
+        printf("Writes <name>.bmp and <name>.qc for every sprite; directories are\n");
+        printf("processed recursively on a thread pool.\n");
+        return 1;
+    }
+
+    if (!outdir)
+        outdir = ".";
+
+    if (make_dir(outdir) < 0)
+    {
+        fprintf(stderr, "Error: Cannot create directory %s\n", outdir);
+        return 1;
+    }
+
+    if (is_directory(input))
+        failures += walk_sprites(input, queue_sprite, (void *)outdir);
+    else
+        add_job(input, outdir);
+
+    run_jobs(numjobs, threads, decompile_job, NULL);
+
+    for (int i = 0; i < numjobs; i++)
+    {
+        free(jobs[i].input);
+        free(jobs[i].outdir);
+    }
+    free(jobs);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,511 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "sprread.h"
+#include "sprtool.h"
+
+/*
+ * Structural comparison of compiled sprites: header fields, palette, the
+ * frame and group layout and finally frame pixels. Both files are mapped
+ * through sprread, so nothing is copied; identical frames are settled by
+ * one memcmp and only differing ones are counted pixel by pixel.
+ */
+
+#define MAX_LISTED 16
+
+enum
+{
+    PAIR_SAME = 0,
+    PAIR_DIFFERENT,
+    PAIR_ONLY_A,
+    PAIR_ONLY_B,
+    PAIR_ERROR
+};
+
+typedef struct
+{
+    const char *name;
+    size_t offset;
+    bool isfloat;
+} headerfield_t;
+
+typedef struct
+{
+    int headerdiffs;
+    int palettediffs;
+    bool palettelayout;
+    bool structure;
+    int intervaldiffs;
+    int firstframe;
+    int framesdiffering;
+    uint64_t pixelsdiffering;
+} diffresult_t;
+
+typedef struct
+{
+    char *name;
+    char *patha;
+    char *pathb;
+    int status;
+    diffresult_t result;
+    char error[128];
+} pair_t;
+
+static const headerfield_t header_fields[] = {
+    {"version", offsetof(spr_header_t, version), false},
+    {"type", offsetof(spr_header_t, type), false},
+    {"texformat", offsetof(spr_header_t, texformat), false},
+    {"boundingradius", offsetof(spr_header_t, boundingradius), true},
+    {"width", offsetof(spr_header_t, width), false},
+    {"height", offsetof(spr_header_t, height), false},
+    {"numframes", offsetof(spr_header_t, numframes), false},
+    {"beamlength", offsetof(spr_header_t, beamlength), true},
+    {"synctype", offsetof(spr_header_t, synctype), false},
+};
+
+#define NUM_HEADER_FIELDS ((int)(sizeof(header_fields) / sizeof(header_fields[0])))
+
+static pair_t *pairs;
+static int numpairs, maxpairs;
+static bool quick;
+
+/*
+ * Number of differing bytes, eight at a time: a byte of a ^ b is nonzero
+ * exactly when adding 0x7f to its low seven bits or its own top bit sets
+ * bit 7, and those bits are summed with one multiply.
+ */
+static uint64_t count_differences(const uint8_t *a, const uint8_t *b, size_t count)
+{
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+    uint64_t total = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        x ^= y;
+        if (!x)
+            continue;
+        uint64_t nonzero = (((x & low7) + low7) | x) & ~low7;
+        total += ((nonzero >> 7) * 0x0101010101010101ull) >> 56;
+    }
+
+    for (; i < count; i++)
+        total += a[i] != b[i];
+
+    return total;
+}
+
+static bool header_field_equal(const spr_header_t *a, const spr_header_t *b, const headerfield_t *field)
+{
+    /* bitwise, so a NaN radius still compares equal to itself */
+    return !memcmp((const uint8_t *)a + field->offset, (const uint8_t *)b + field->offset, 4);
+}
+
+static void print_header_field(FILE *f, const spr_header_t *header, const headerfield_t *field)
+{
+    const uint8_t *p = (const uint8_t *)header + field->offset;
+
+    if (field->isfloat)
+    {
+        float value;
+        memcpy(&value, p, sizeof(value));
+        fprintf(f, "%g", value);
+    }
+    else
+    {
+        int32_t value;
+        memcpy(&value, p, sizeof(value));
+        fprintf(f, "%d", (int)value);
+    }
+}
+
+static bool frames_same_geometry(const spr_frame_t *a, const spr_frame_t *b)
+{
+    return a->width == b->width && a->height == b->height &&
+           a->origin[0] == b->origin[0] && a->origin[1] == b->origin[1];
+}
+
+/*
+ * Compares two open sprites. With detail set, every difference found is
+ * described there as well. In quick mode the comparison stops at the first
+ * difference, which is all a pass/fail gate needs.
+ */
+static bool compare_sprites(const spr_file_t *a, const spr_file_t *b, diffresult_t *result, FILE *detail)
+{
+    int listed;
+
+    memset(result, 0, sizeof(*result));
+    result->firstframe = -1;
+
+    for (int i = 0; i < NUM_HEADER_FIELDS; i++)
+    {
+        const headerfield_t *field = &header_fields[i];
+        if (header_field_equal(&a->header, &b->header, field))
+            continue;
+
+        result->headerdiffs++;
+        if (detail)
+        {
+            fprintf(detail, "header %s: ", field->name);
+            print_header_field(detail, &a->header, field);
+            fprintf(detail, " -> ");
+            print_header_field(detail, &b->header, field);
+            fprintf(detail, "\n");
+        }
+        if (quick)
+            return false;
+    }
+
+    if (!a->palette != !b->palette || a->palettecolors != b->palettecolors)
+    {
+        result->palettelayout = true;
+        if (detail)
+            fprintf(detail, "palette: %d -> %d color(s)\n", a->palettecolors, b->palettecolors);
+        if (quick)
+            return false;
+    }
+
+    int colors = a->palettecolors < b->palettecolors ? a->palettecolors : b->palettecolors;
+    if (colors && memcmp(a->palette, b->palette, (size_t)colors * 3))
+    {
+        listed = 0;
+        for (int i = 0; i < colors; i++)
+        {
+            const uint8_t *ca = a->palette + i * 3;
+            const uint8_t *cb = b->palette + i * 3;
+            if (!memcmp(ca, cb, 3))
+                continue;
+
+            result->palettediffs++;
+            if (detail && listed++ < MAX_LISTED)
+                fprintf(detail, "palette %d: %d %d %d -> %d %d %d\n", i, ca[0], ca[1], ca[2], cb[0], cb[1], cb[2]);
+        }
+        if (detail && listed > MAX_LISTED)
+            fprintf(detail, "palette: %d more changed entr(ies)\n", listed - MAX_LISTED);
+        if (quick)
+            return false;
+    }
+
+    if (a->numentries != b->numentries || a->numframes != b->numframes)
+    {
+        result->structure = true;
+        if (detail)
+            fprintf(detail, "layout: %d entr(ies), %d frame(s) -> %d entr(ies), %d frame(s)\n",
+                    a->numentries, a->numframes, b->numentries, b->numframes);
+        if (quick)
+            return false;
+    }
+
+    int numentries = a->numentries < b->numentries ? a->numentries : b->numentries;
+    for (int i = 0; i < numentries; i++)
+    {
+        const spr_entry_t *ea = &a->entries[i];
+        const spr_entry_t *eb = &b->entries[i];
+
+        if (ea->type != eb->type || ea->numframes != eb->numframes)
+        {
+            if (detail && !result->structure)
+                fprintf(detail, "entry %d: type %d with %d frame(s) -> type %d with %d frame(s)\n",
+                        i, ea->type, ea->numframes, eb->type, eb->numframes);
+            result->structure = true;
+            if (quick)
+                return false;
+            continue;
+        }
+
+        for (int j = 0; j < ea->numframes && ea->type != SPR_SINGLE; j++)
+        {
+            float ia = spr_group_interval(a, i, j);
+            float ib = spr_group_interval(b, i, j);
+            if (!memcmp(&ia, &ib, sizeof(ia)))
+                continue;
+
+            if (detail && !result->intervaldiffs)
+                fprintf(detail, "entry %d: interval %d ends at %g -> %g\n", i, j, ia, ib);
+            result->intervaldiffs++;
+            if (quick)
+                return false;
+        }
+    }
+
+    int numframes = a->numframes < b->numframes ? a->numframes : b->numframes;
+    listed = 0;
+    for (int i = 0; i < numframes; i++)
+    {
+        spr_frame_t fa = spr_frame(a, i);
+        spr_frame_t fb = spr_frame(b, i);
+        size_t size = (size_t)fa.width * fa.height;
+        uint64_t differing;
+
+        if (!frames_same_geometry(&fa, &fb))
+        {
+            differing = size > (size_t)fb.width * fb.height ? size : (size_t)fb.width * fb.height;
+            if (detail && listed++ < MAX_LISTED)
+                fprintf(detail, "frame %d: %dx%d at %d,%d -> %dx%d at %d,%d\n", i,
+                        fa.width, fa.height, fa.origin[0], fa.origin[1],
+                        fb.width, fb.height, fb.origin[0], fb.origin[1]);
+        }
+        else if (!memcmp(fa.pixels, fb.pixels, size))
+        {
+            continue;
+        }
+        else
+        {
+            differing = quick ? 1 : count_differences(fa.pixels, fb.pixels, size);
+            if (detail && listed++ < MAX_LISTED)
+                fprintf(detail, "frame %d: %llu of %zu pixel(s) differ\n", i, (unsigned long long)differing, size);
+        }
+
+        if (result->firstframe < 0)
+            result->firstframe = i;
+        result->framesdiffering++;
+        result->pixelsdiffering += differing;
+        if (quick)
+            return false;
+    }
+    if (detail && listed > MAX_LISTED)
+        fprintf(detail, "%d more differing frame(s)\n", listed - MAX_LISTED);
+
+    return !result->headerdiffs && !result->palettelayout && !result->palettediffs && !result->structure &&
+           !result->intervaldiffs && !result->framesdiffering;
+}
+
+static void add_pair(const char *name, const char *patha, const char *pathb, int status)
+{
+    if (numpairs == maxpairs)
+    {
+        maxpairs = maxpairs ? maxpairs * 2 : 64;
+        pairs = xrealloc(pairs, maxpairs * sizeof(pair_t));
+    }
+
+    pair_t *pair = &pairs[numpairs++];
+    memset(pair, 0, sizeof(*pair));
+    pair->name = xstrdup(name);
+    pair->patha = patha ? xstrdup(patha) : NULL;
+    pair->pathb = pathb ? xstrdup(pathb) : NULL;
+    pair->status = status;
+}
+
+static bool is_file(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && !S_ISDIR(st.st_mode);
+}
+
+/*
+ * Pairs every sprite under the first tree with the same relative path
+ * under the second (arg). A second walk over the second tree only picks
+ * up the sprites that exist there alone.
+ */
+static void pair_from_a(const char *path, const char *relative, void *arg)
+{
+    const char *dirb = arg;
+    char *other = xmalloc(strlen(dirb) + strlen(relative) + 2);
+    sprintf(other, "%s/%s", dirb, relative);
+
+    bool paired = is_file(other);
+    add_pair(relative, path, paired ? other : NULL, paired ? PAIR_SAME : PAIR_ONLY_A);
+    free(other);
+}
+
+static void pair_from_b(const char *path, const char *relative, void *arg)
+{
+    const char *dira = arg;
+    char *other = xmalloc(strlen(dira) + strlen(relative) + 2);
+    sprintf(other, "%s/%s", dira, relative);
+
+    if (!is_file(other))
+        add_pair(relative, NULL, path, PAIR_ONLY_B);
+    free(other);
+}
+
+static int compare_pair_names(const void *a, const void *b)
+{
+    return strcmp(((const pair_t *)a)->name, ((const pair_t *)b)->name);
+}
+
+static void compare_pair(pair_t *pair)
+{
+    spr_file_t a, b;
+    int result;
+
+    if ((result = spr_open(&a, pair->patha)) != SPR_OK)
+    {
+        pair->status = PAIR_ERROR;
+        snprintf(pair->error, sizeof(pair->error), "%s: %s", pair->patha, spr_strerror(result));
+        return;
+    }
+    if ((result = spr_open(&b, pair->pathb)) != SPR_OK)
+    {
+        pair->status = PAIR_ERROR;
+        snprintf(pair->error, sizeof(pair->error), "%s: %s", pair->pathb, spr_strerror(result));
+        spr_close(&a);
+        return;
+    }
+
+    pair->status = compare_sprites(&a, &b, &pair->result, NULL) ? PAIR_SAME : PAIR_DIFFERENT;
+
+    spr_close(&a);
+    spr_close(&b);
+}
+
+static void compare_job(int index, void *arg)
+{
+    (void)arg;
+
+    /* pairs missing a side have nothing to compare */
+    if (pairs[index].patha && pairs[index].pathb)
+        compare_pair(&pairs[index]);
+}
+
+static void print_pair_summary(const pair_t *pair)
+{
+    const diffresult_t *r = &pair->result;
+
+    switch (pair->status)
+    {
+    case PAIR_ONLY_A:
+        printf("%s: only in first\n", pair->name);
+        return;
+    case PAIR_ONLY_B:
+        printf("%s: only in second\n", pair->name);
+        return;
+    case PAIR_ERROR:
+        printf("%s: error: %s\n", pair->name, pair->error[0] ? pair->error : "cannot read");
+        return;
+    case PAIR_SAME:
+        return;
+    }
+
+    printf("%s: differs:", pair->name);
+    if (r->headerdiffs)
+        printf(" %d header field(s)", r->headerdiffs);
+    if (r->palettelayout)
+        printf(" palette size");
+    if (r->palettediffs)
+        printf(" %d palette entr(ies)", r->palettediffs);
+    if (r->structure)
+        printf(" layout");
+    if (r->intervaldiffs)
+        printf(" %d interval(s)", r->intervaldiffs);
+    if (r->framesdiffering)
+        printf(" %d frame(s) from frame %d, %llu pixel(s)", r->framesdiffering, r->firstframe,
+               (unsigned long long)r->pixelsdiffering);
+    printf("\n");
+}
+
+static int diff_files(const char *patha, const char *pathb)
+{
+    spr_file_t a, b;
+    diffresult_t result;
+    int code;
+
+    if ((code = spr_open(&a, patha)) != SPR_OK)
+    {
+        fprintf(stderr, "Error: %s: %s\n", patha, spr_strerror(code));
+        return 2;
+    }
+    if ((code = spr_open(&b, pathb)) != SPR_OK)
+    {
+        fprintf(stderr, "Error: %s: %s\n", pathb, spr_strerror(code));
+        spr_close(&a);
+        return 2;
+    }
+
+    bool same = compare_sprites(&a, &b, &result, stdout);
+
+    if (same)
+        printf("sprdiff: identical\n");
+    else if (result.framesdiffering)
+        printf("sprdiff: differ, first differing frame %d, %d frame(s), %llu pixel(s)\n",
+               result.firstframe, result.framesdiffering, (unsigned long long)result.pixelsdiffering);
+    else
+        printf("sprdiff: differ, frame pixels identical\n");
+
+    spr_close(&a);
+    spr_close(&b);
+    return same ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 0;
+    const char *inputs[2] = {NULL, NULL};
+    int numinputs = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quick"))
+        {
+            quick = true;
+        }
+        else if (numinputs < 2)
+        {
+            inputs[numinputs++] = argv[i];
+        }
+        else
+        {
+            numinputs = 0;
+            break;
+        }
+    }
+
+    if (numinputs != 2)
+    {
+        printf("Usage: %s [-j threads] [-q|--quick] <a.spr> <b.spr>\n", argv[0]);
+        printf("       %s [-j threads] [-q|--quick] <dir-a> <dir-b>\n", argv[0]);
+        printf("Compares headers, palettes, layout and frame pixels. Exits 0 when\n");
+        printf("everything matches, 1 on differences and 2 on errors. --quick stops\n");
+        printf("at the first difference of each pair.\n");
+        return 2;
+    }
+
+    if (!is_directory(inputs[0]) || !is_directory(inputs[1]))
+        return diff_files(inputs[0], inputs[1]);
+
+    /* unreadable directories count as errors */
+    int walkerrors = walk_sprites(inputs[0], pair_from_a, (void *)inputs[1]);
+    walkerrors += walk_sprites(inputs[1], pair_from_b, (void *)inputs[0]);
+    qsort(pairs, numpairs, sizeof(pair_t), compare_pair_names);
+
+    double start = now_seconds();
+    run_jobs(numpairs, threads, compare_job, NULL);
+    double elapsed = now_seconds() - start;
+    int counts[PAIR_ERROR + 1] = {0};
+
+    counts[PAIR_ERROR] = walkerrors;
+    for (int i = 0; i < numpairs; i++)
+    {
+        print_pair_summary(&pairs[i]);
+        counts[pairs[i].status]++;
+    }
+
+    printf("sprdiff: %d identical, %d differ, %d only in first, %d only in second, %d error(s) in %.3f s\n",
+           counts[PAIR_SAME], counts[PAIR_DIFFERENT], counts[PAIR_ONLY_A], counts[PAIR_ONLY_B],
+           counts[PAIR_ERROR], elapsed);
+
+    for (int i = 0; i < numpairs; i++)
+    {
+        free(pairs[i].name);
+        free(pairs[i].patha);
+        free(pairs[i].pathb);
+    }
+    free(pairs);
+
+    if (counts[PAIR_ERROR])
+        return 2;
+    return counts[PAIR_DIFFERENT] || counts[PAIR_ONLY_A] || counts[PAIR_ONLY_B] ? 1 : 0;
+}
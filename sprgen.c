@@ -1,12 +1,29 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <math.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include "sprtool.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 typedef unsigned char byte;
 
@@ -17,6 +34,27 @@ typedef unsigned char byte;
 #define INITIAL_MAX_FRAMES 1000
 #define INITIAL_TOKEN_SIZE 1024
 #define PALETTE_SIZE 256
+#define PREFETCH_DEPTH 4
+#define GRID_PARALLEL_PIXELS (1 << 20)
+#define PACK_MAX_LITERAL 128
+#define PACK_MAX_RUN 129
+#define QUALITY_EXCLUDED 0xffffffffu
+#define PLAN_HEADER_BYTES 256
+#define FRAMEFILE_BATCH 32
+
+#define BI_RGB 0
+#define BI_RLE8 1
+#define BI_RLE4 2
+#define BI_BITFIELDS 3
+#define PALETTE_FILE_SIZE (PALETTE_SIZE * 3)
+#define COLOR_CELL_BITS 5
+#define COLOR_CELL_SHIFT (8 - COLOR_CELL_BITS)
+#define COLOR_CELLS (1 << (3 * COLOR_CELL_BITS))
+#define HISTOGRAM_MAX_BINS (1 << 18)
+#define TRANSPARENT_INDEX (PALETTE_SIZE - 1)
+#define DEFAULT_ALPHA_THRESHOLD 128
+#define DITHER_SPREAD 32
+#define DITHER_BLOCK 64
 
 typedef enum
 {
@@ -28,6 +66,12 @@ typedef enum
     SPR_SINGLE = 0,
     SPR_GROUP
 } spriteframetype_t;
+typedef enum
+{
+    DITHER_NONE = 0,
+    DITHER_ORDERED,
+    DITHER_FS
+} dithermode_t;
 
 typedef struct
 {
@@ -73,6 +117,199 @@ typedef struct
     int numgroupframes;
 } spritepackage_t;
 
+typedef struct
+{
+    char *text;
+    size_t size;
+    bool unterminated;
+} tokenbuf_t;
+
+typedef struct
+{
+    int width;
+    int height;
+    int bpp;
+    byte palette[PALETTE_SIZE * 3];
+    byte *pixels;
+} bmpimage_t;
+
+typedef struct
+{
+    int header_size;
+    int width;
+    int height;
+    int bpp;
+    int compression;
+    int data_offset;
+    int colors_used;
+    bool topdown;
+    int shifts[4];
+} bmpheader_t;
+
+typedef struct
+{
+    char *name;
+    char *path;
+    bmpimage_t image;
+    size_t archivebytes;
+    bool ok;
+    bool done;
+} prefetchjob_t;
+
+typedef struct
+{
+    char *name;
+    size_t offset;
+    size_t size;
+} vfsentry_t;
+
+typedef struct
+{
+    char *path;
+    byte *data;
+    size_t size;
+    vfsentry_t *entries;
+    int numentries;
+    int maxentries;
+    int *hash;
+    int hashsize;
+} vfsarchive_t;
+
+typedef struct
+{
+    byte *base;
+    size_t stride;
+    int x0, y0;
+    int w, h;
+    int cols;
+} gridcopy_t;
+
+typedef struct
+{
+    uint64_t pixels;
+    uint64_t sumsq;
+    int maxerror;
+} qualitysum_t;
+
+/* One $framefile entry, from the script through to its frame slot. */
+typedef struct
+{
+    char *name;
+    char *path;
+    float interval;
+    bool hasorigin;
+    int origin[2];
+    int width, height;
+    bmpimage_t image;
+    size_t archivebytes;
+    bool ok;
+    bool remapped;
+    byte remap[PALETTE_SIZE];
+    byte *dest;
+    qualitysum_t quality;
+} framefile_t;
+
+typedef struct
+{
+    uint32_t key;
+    uint64_t count;
+    uint64_t sum[3];
+} colorbin_t;
+
+typedef struct
+{
+    colorbin_t *bins;
+    size_t size;
+    size_t used;
+    int shift;
+} histogram_t;
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum[3];
+    byte rgb[3];
+} colorpoint_t;
+
+typedef struct
+{
+    int first, count;
+    uint64_t weight;
+    int axis, range;
+} colorbox_t;
+
+typedef struct
+{
+    char **names;
+    char **paths;
+    int numimages, maximages;
+    histogram_t *histograms;
+    int numhistograms;
+    uint64_t pixels;
+    pthread_mutex_t lock;
+} palettebuild_t;
+
+typedef struct
+{
+    char *outname;
+    int type;
+    int texformat;
+} spritevariant_t;
+
+typedef struct
+{
+    char *name;
+    int width, height;
+    qualitysum_t sum;
+} qualitysheet_t;
+
+typedef struct
+{
+    char *sprite;
+    int frame;
+    int sheet;
+    int x, y, w, h;
+    qualitysum_t sum;
+} qualityframe_t;
+
+typedef struct
+{
+    const bmpimage_t *image;
+    byte *dest;
+    bool keyed;
+    qualitysum_t *quality;
+    pthread_mutex_t lock;
+} convertjob_t;
+
+typedef struct
+{
+    const bmpimage_t *image;
+    byte *dest;
+    bool keyed;
+    int lanes;
+    int ringsize;
+    int *errors;
+    qualitysum_t *quality;
+    int *blocksdone;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+} ditherjob_t;
+
+typedef struct
+{
+    void (*func)(void *arg, int begin, int end);
+    void *arg;
+    int begin, end;
+    bool done;
+} rangetask_t;
+
+typedef struct task_s
+{
+    void (*func)(void *arg);
+    void *arg;
+    struct task_s *next;
+} task_t;
+
 #define SPR_VP_PARALLEL_UPRIGHT 0
 #define SPR_FACING_UPRIGHT 1
 #define SPR_VP_PARALLEL 2
@@ -98,13 +335,95 @@ static spritepackage_t *frames;
 static int max_frames = INITIAL_MAX_FRAMES;
 static size_t buffer_size = INITIAL_BUFFER_SIZE;
 static bool do16bit = true;
+static FILE *msgout;
+static byte *outbuffer;
+static size_t outbuffer_size, outlength;
+static spritevariant_t *variants;
+static int numvariants, maxvariants;
+static bool compact_frames;
+static bool plan_mode;
+static int plan_sprites;
+
+/*
+ * --quality-report: the conversion loops add up each sheet's error as they
+ * go, one partial sum per worker slice. The current $load sheet's source
+ * pixels are kept until the next $load, so a frame cut from it is measured
+ * over just its own rectangle. Paletted sources and indexalpha sheets only
+ * need the error per source index (packed as max channel error << 24 |
+ * squared RGB error, or QUALITY_EXCLUDED for indices that carry no color).
+ */
+static const char *quality_report_name;
+static byte *qualitypixels; /* source of the current sheet, when byteimage does not hold it */
+static bool qualitytruecolor;
+static bool qualitykeyed;
+static byte qualitypalette[PALETTE_SIZE * 3];
+static uint32_t qualityerrors[PALETTE_SIZE];
+static qualitysheet_t *qualitysheets;
+static int numqualitysheets, maxqualitysheets;
+static int loaded_quality_sheet = -1; /* the current $load sheet; $framefile adds its own */
+static qualityframe_t *qualityframes;
+static int numqualityframes, maxqualityframes;
+static int quality_sprite_frames;
+static size_t store_raw_bytes, store_peak_raw, store_peak_packed;
+static tokenbuf_t scripttoken;
 static char *token;
-static size_t token_size = INITIAL_TOKEN_SIZE;
 static char *scriptbuffer;
 static char *scriptptr;
 static char *scriptend;
 static byte *original_palette = NULL;
 static bool palette_established = false;
+static byte *fixed_palette = NULL;
+static int alpha_threshold = DEFAULT_ALPHA_THRESHOLD;
+static dithermode_t dither_mode = DITHER_NONE;
+
+static const byte bayer8[64] = {
+    0, 32, 8, 40, 2, 34, 10, 42,
+    48, 16, 56, 24, 50, 18, 58, 26,
+    12, 44, 4, 36, 14, 46, 6, 38,
+    60, 28, 52, 20, 62, 30, 54, 22,
+    3, 35, 11, 43, 1, 33, 9, 41,
+    51, 19, 59, 27, 49, 17, 57, 25,
+    15, 47, 7, 39, 13, 45, 5, 37,
+    63, 31, 55, 23, 61, 29, 53, 21};
+
+/*
+ * RGB -> palette index acceleration table. The color cube is split into
+ * COLOR_CELLS cells and every cell keeps the (ascending) list of palette
+ * entries that can be the nearest match for some color inside it, so a
+ * lookup only scans a handful of candidates instead of all 256 entries
+ * while still returning exactly what the full scan would.
+ */
+typedef struct
+{
+    byte palette[PALETTE_SIZE * 3];
+    int entries;
+    int *cellstart;
+    byte *candidates;
+    size_t candidates_size;
+    bool valid;
+} colorlookup_t;
+
+static colorlookup_t colorlookup;
+
+static pthread_t *workers;
+static int numworkers;
+static int requested_threads;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static task_t *task_head, *task_tail;
+static bool pool_stopping;
+
+static bool prefetch_enabled = true;
+static prefetchjob_t prefetchqueue[PREFETCH_DEPTH];
+static int prefetchhead, prefetchcount;
+static char *prefetchptr;
+static tokenbuf_t prefetchtoken;
+
+static vfsarchive_t *archives;
+static int numarchives;
+static int vfs_hits, vfs_disk_reads;
+static size_t vfs_bytes_read, vfs_bytes_mapped;
 
 static void error(const char *fmt, ...)
 {
@@ -157,14 +476,142 @@ static void safe_read(FILE *f, void *buffer, int count)
     }
 }
 
-static void safe_write(FILE *f, void *buffer, int count)
+static void safe_write(FILE *f, const void *buffer, size_t count)
 {
-    if (fwrite(buffer, 1, count, f) != (size_t)count)
+    if (fwrite(buffer, 1, count, f) != count)
     {
         error("File write failure");
     }
 }
 
+static void *worker_main(void *arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool_lock);
+        while (!task_head && !pool_stopping)
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        if (!task_head)
+        {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        task_t *task = task_head;
+        task_head = task->next;
+        if (!task_head)
+            task_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        task->func(task->arg);
+        free(task);
+    }
+}
+
+static void start_workers(int count)
+{
+    workers = safe_malloc(count * sizeof(pthread_t));
+    for (int i = 0; i < count; i++)
+    {
+        if (pthread_create(&workers[i], NULL, worker_main, NULL))
+            error("Could not start worker thread");
+    }
+    numworkers = count;
+}
+
+static void stop_workers(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = true;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 0; i < numworkers; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    workers = NULL;
+    numworkers = 0;
+}
+
+static void submit_task(void (*func)(void *arg), void *arg)
+{
+    task_t *task = safe_malloc(sizeof(task_t));
+    task->func = func;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (task_tail)
+        task_tail->next = task;
+    else
+        task_head = task;
+    task_tail = task;
+    pthread_cond_signal(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Marks a task result as ready and wakes whoever waits for it. */
+static void complete_task(bool *done)
+{
+    pthread_mutex_lock(&pool_lock);
+    *done = true;
+    pthread_cond_broadcast(&pool_done);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void wait_task(const bool *done)
+{
+    pthread_mutex_lock(&pool_lock);
+    while (!*done)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void range_task(void *arg)
+{
+    rangetask_t *task = arg;
+    task->func(task->arg, task->begin, task->end);
+    complete_task(&task->done);
+}
+
+/*
+ * Splits [0, count) into one slice per worker plus one for the calling
+ * thread and returns once every slice has run.
+ */
+static void parallel_for(int count, void (*func)(void *arg, int begin, int end), void *arg)
+{
+    int slices = numworkers + 1;
+    if (slices > count)
+        slices = count;
+
+    if (slices <= 1)
+    {
+        if (count > 0)
+            func(arg, 0, count);
+        return;
+    }
+
+    rangetask_t *tasks = safe_malloc(slices * sizeof(rangetask_t));
+    for (int i = 0; i < slices; i++)
+    {
+        tasks[i].func = func;
+        tasks[i].arg = arg;
+        tasks[i].begin = (int)((long long)count * i / slices);
+        tasks[i].end = (int)((long long)count * (i + 1) / slices);
+        tasks[i].done = false;
+        if (i > 0)
+            submit_task(range_task, &tasks[i]);
+    }
+
+    func(arg, tasks[0].begin, tasks[0].end);
+
+    for (int i = 1; i < slices; i++)
+        wait_task(&tasks[i].done);
+    free(tasks);
+}
+
 static bool is_absolute_path(const char *path)
 {
     if (!path || !path[0])
@@ -179,37 +626,94 @@ static bool is_absolute_path(const char *path)
     return false;
 }
 
-static void ensure_token_capacity(size_t needed)
+/*
+ * Directory that a script's relative paths resolve against: basedir when
+ * given, otherwise the directory the script lives in.
+ */
+static char *script_dir(const char *filename, const char *basedir)
 {
-    if (needed > token_size)
+    char *dir;
+
+    if (basedir)
+    {
+        size_t length = strlen(basedir);
+        dir = safe_malloc(length + 2);
+        strcpy(dir, basedir);
+        if (length && dir[length - 1] != '/' && dir[length - 1] != '\\')
+            strcat(dir, "/");
+        return dir;
+    }
+
+    dir = safe_malloc(strlen(filename) + 3);
+    strcpy(dir, filename);
+    for (int j = (int)strlen(dir) - 1; j >= 0; j--)
     {
-        token_size = needed * 2;
-        token = safe_realloc(token, token_size);
+        if (dir[j] == '/' || dir[j] == '\\')
+        {
+            dir[j + 1] = 0;
+            return dir;
+        }
     }
+    strcpy(dir, "./");
+    return dir;
 }
 
-static bool get_token(bool crossline)
+static char *resolve_path(const char *filename)
+{
+    char *path;
+
+    if (is_absolute_path(filename))
+    {
+        path = safe_malloc(strlen(filename) + 1);
+        strcpy(path, filename);
+        return path;
+    }
+
+    path = safe_malloc(strlen(spritedir) + strlen(filename) + 1);
+    strcpy(path, spritedir);
+    strcat(path, filename);
+    return path;
+}
+
+static void ensure_token_capacity(tokenbuf_t *buf, size_t needed)
+{
+    if (needed > buf->size)
+    {
+        buf->size = needed * 2;
+        buf->text = safe_realloc(buf->text, buf->size);
+    }
+}
+
+/*
+ * Reads the next token at *cursor into buf. Used both by the parser and by
+ * the prefetch scanner, which walks the same script ahead of it.
+ */
+static bool parse_token(char **cursor, tokenbuf_t *buf, bool crossline)
 {
     char *token_p;
+    char *p = *cursor;
 
-    if (token == NULL)
+    if (buf->text == NULL)
     {
-        token = safe_malloc(token_size);
+        if (!buf->size)
+            buf->size = INITIAL_TOKEN_SIZE;
+        buf->text = safe_malloc(buf->size);
     }
 
 skip_whitespace:
-    if (!scriptptr || scriptptr >= scriptend)
+    if (!p || p >= scriptend)
     {
+        *cursor = p;
         return false;
     }
 
-    char c = *scriptptr++;
+    char c = *p++;
 
     if (c == '\n')
     {
         if (!crossline)
         {
-            scriptptr--;
+            *cursor = p - 1;
             return false;
         }
         goto skip_whitespace;
@@ -218,81 +722,119 @@ skip_whitespace:
     if (c <= ' ')
         goto skip_whitespace;
 
-    if (c == '/' && scriptptr < scriptend && *scriptptr == '/')
+    if (c == '/' && p < scriptend && *p == '/')
     {
         if (!crossline)
         {
-            scriptptr--;
+            *cursor = p - 1;
             return false;
         }
-        while (scriptptr < scriptend && *scriptptr != '\n')
+        while (p < scriptend && *p != '\n')
         {
-            scriptptr++;
+            p++;
         }
         goto skip_whitespace;
     }
 
-    scriptptr--;
+    p--;
 
-    token_p = token;
+    token_p = buf->text;
 
     if (c == '"')
     {
-        scriptptr++;
-        while (scriptptr < scriptend)
+        p++;
+        while (p < scriptend)
         {
-            c = *scriptptr++;
+            c = *p++;
             if (c == '"')
             {
                 *token_p = 0;
+                *cursor = p;
                 return true;
             }
-            if ((token_p - token) >= (ptrdiff_t)(token_size - 1))
+            if ((token_p - buf->text) >= (ptrdiff_t)(buf->size - 1))
             {
-                size_t pos = token_p - token;
-                ensure_token_capacity(token_size * 2);
-                token_p = token + pos;
+                size_t pos = token_p - buf->text;
+                ensure_token_capacity(buf, buf->size * 2);
+                token_p = buf->text + pos;
             }
             *token_p++ = c;
         }
-        error("EOF inside quoted token");
+        *token_p = 0;
+        *cursor = p;
+        buf->unterminated = true;
+        return false;
     }
 
     do
     {
-        c = *scriptptr++;
+        c = *p++;
         if (c <= 32)
             break;
-        if ((token_p - token) >= (ptrdiff_t)(token_size - 1))
+        if ((token_p - buf->text) >= (ptrdiff_t)(buf->size - 1))
         {
-            size_t pos = token_p - token;
-            ensure_token_capacity(token_size * 2);
-            token_p = token + pos;
+            size_t pos = token_p - buf->text;
+            ensure_token_capacity(buf, buf->size * 2);
+            token_p = buf->text + pos;
         }
         *token_p++ = c;
-        if (scriptptr >= scriptend)
+        if (p >= scriptend)
             break;
     } while (true);
 
-    if (scriptptr < scriptend)
-        scriptptr--;
+    if (p < scriptend)
+        p--;
 
     *token_p = 0;
+    *cursor = p;
     return true;
 }
 
+static bool get_token(bool crossline)
+{
+    bool result = parse_token(&scriptptr, &scripttoken, crossline);
+    if (scripttoken.unterminated)
+        error("EOF inside quoted token");
+    token = scripttoken.text;
+    return result;
+}
+
 static void start_script_parse(const char *filename)
 {
-    FILE *f = safe_open_read(filename);
-    fseek(f, 0, SEEK_END);
-    long length = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    size_t length = 0;
 
-    scriptbuffer = safe_malloc(length + 1);
-    safe_read(f, scriptbuffer, length);
-    scriptbuffer[length] = 0;
-    fclose(f);
+    if (!strcmp(filename, "-"))
+    {
+        /* stdin may be a pipe, so grow the buffer as the script arrives */
+        size_t capacity = INITIAL_BUFFER_SIZE;
+        size_t count;
+
+        scriptbuffer = safe_malloc(capacity + 1);
+        while ((count = fread(scriptbuffer + length, 1, capacity - length, stdin)) > 0)
+        {
+            length += count;
+            if (length == capacity)
+            {
+                capacity *= 2;
+                scriptbuffer = safe_realloc(scriptbuffer, capacity + 1);
+            }
+        }
+        if (ferror(stdin))
+            error("File read failure");
+    }
+    else
+    {
+        FILE *f = safe_open_read(filename);
+        fseek(f, 0, SEEK_END);
+        length = ftell(f);
+        fseek(f, 0, SEEK_SET);
+
+        scriptbuffer = safe_malloc(length + 1);
+        safe_read(f, scriptbuffer, length);
+        fclose(f);
+    }
 
+    scriptbuffer[length] = 0;
     scriptptr = scriptbuffer;
     scriptend = scriptbuffer + length;
 }
@@ -363,268 +905,2057 @@ static void ensure_buffer_capacity(size_t needed)
     }
 }
 
-static void ensure_frame_capacity(void)
+static void ensure_frame_capacity(int count)
 {
-    if (framecount >= max_frames)
+    if (framecount + count > max_frames)
     {
-        max_frames *= 2;
+        while (framecount + count > max_frames)
+            max_frames *= 2;
         frames = safe_realloc(frames, max_frames * sizeof(spritepackage_t));
     }
 }
 
-static void load_bmp(const char *filename)
+/*
+ * Only the first `entries` palette slots take part in the search, so a
+ * reserved index (TRANSPARENT_INDEX for alphatest) is never picked for an
+ * opaque pixel.
+ */
+static void build_color_lookup(const byte *palette, int entries)
 {
-    const char *path_to_open = filename;
-    char *fullpath = NULL;
-
-    if (!is_absolute_path(filename))
-    {
-        size_t needed = strlen(spritedir) + strlen(filename) + 1;
-        fullpath = safe_malloc(needed);
-        strcpy(fullpath, spritedir);
-        strcat(fullpath, filename);
-        path_to_open = fullpath;
-    }
+    int unique[PALETTE_SIZE];
+    int numunique = 0;
+    int mind[PALETTE_SIZE];
+    size_t count = 0;
 
-    FILE *f = safe_open_read(path_to_open);
+    if (colorlookup.valid && colorlookup.entries == entries &&
+        !memcmp(colorlookup.palette, palette, PALETTE_SIZE * 3))
+        return;
 
-    byte header[54];
-    safe_read(f, header, 54);
+    memcpy(colorlookup.palette, palette, PALETTE_SIZE * 3);
+    colorlookup.entries = entries;
 
-    if (header[0] != 'B' || header[1] != 'M')
+    /* a repeated entry can never beat its first occurrence */
+    for (int i = 0; i < entries; i++)
     {
-        error("%s is not a valid BMP file", path_to_open);
+        int j;
+        for (j = 0; j < numunique; j++)
+        {
+            if (!memcmp(palette + unique[j] * 3, palette + i * 3, 3))
+                break;
+        }
+        if (j == numunique)
+            unique[numunique++] = i;
     }
 
-    int width = *(int *)(header + 18);
-    int height = *(int *)(header + 22);
-    short bpp = *(short *)(header + 28);
-    int data_offset = *(int *)(header + 10);
-    int colors_used = *(int *)(header + 46);
-
-    if (width <= 0 || height <= 0)
+    if (!colorlookup.cellstart)
+        colorlookup.cellstart = safe_malloc((COLOR_CELLS + 1) * sizeof(int));
+    if (!colorlookup.candidates)
     {
-        error("Invalid dimensions in %s", path_to_open);
+        colorlookup.candidates_size = COLOR_CELLS * 8;
+        colorlookup.candidates = safe_malloc(colorlookup.candidates_size);
     }
 
-    byteimagewidth = width;
-    byteimageheight = height;
-
-    if (lbmpalette)
-        free(lbmpalette);
-    lbmpalette = safe_malloc(PALETTE_SIZE * 3);
-
-    if (bpp == 8)
+    for (int cell = 0; cell < COLOR_CELLS; cell++)
     {
-        int palette_colors = colors_used ? colors_used : PALETTE_SIZE;
-        fseek(f, 54, SEEK_SET);
+        int lo[3], hi[3];
+        int bestmax = 0x7fffffff;
+
+        lo[0] = (cell >> (2 * COLOR_CELL_BITS)) << COLOR_CELL_SHIFT;
+        lo[1] = ((cell >> COLOR_CELL_BITS) & ((1 << COLOR_CELL_BITS) - 1)) << COLOR_CELL_SHIFT;
+        lo[2] = (cell & ((1 << COLOR_CELL_BITS) - 1)) << COLOR_CELL_SHIFT;
+        for (int c = 0; c < 3; c++)
+            hi[c] = lo[c] + (1 << COLOR_CELL_SHIFT) - 1;
 
-        for (int i = 0; i < palette_colors; i++)
+        for (int u = 0; u < numunique; u++)
         {
-            byte bgra[4];
-            if (fread(bgra, 1, 4, f) != 4)
+            const byte *entry = palette + unique[u] * 3;
+            int dmin = 0, dmax = 0;
+
+            for (int c = 0; c < 3; c++)
             {
-                memset(bgra, 0, 4);
+                int v = entry[c];
+                int dlo = v - lo[c];
+                int dhi = hi[c] - v;
+
+                if (v < lo[c])
+                    dmin += dlo * dlo;
+                else if (v > hi[c])
+                    dmin += dhi * dhi;
+
+                if (dlo * dlo > dhi * dhi)
+                    dmax += dlo * dlo;
+                else
+                    dmax += dhi * dhi;
             }
-            lbmpalette[i * 3] = bgra[2];
-            lbmpalette[i * 3 + 1] = bgra[1];
-            lbmpalette[i * 3 + 2] = bgra[0];
+
+            mind[u] = dmin;
+            if (dmax < bestmax)
+                bestmax = dmax;
         }
 
-        for (int i = palette_colors; i < PALETTE_SIZE; i++)
+        if (count + numunique > colorlookup.candidates_size)
         {
-            lbmpalette[i * 3] = 0;
-            lbmpalette[i * 3 + 1] = 0;
-            lbmpalette[i * 3 + 2] = 0;
+            colorlookup.candidates_size = (count + numunique) * 2;
+            colorlookup.candidates = safe_realloc(colorlookup.candidates, colorlookup.candidates_size);
         }
 
-        if (!palette_established)
+        colorlookup.cellstart[cell] = (int)count;
+        for (int u = 0; u < numunique; u++)
         {
-            if (original_palette)
-                free(original_palette);
-            original_palette = safe_malloc(PALETTE_SIZE * 3);
-            memcpy(original_palette, lbmpalette, PALETTE_SIZE * 3);
-            palette_established = true;
+            if (mind[u] <= bestmax)
+                colorlookup.candidates[count++] = (byte)unique[u];
         }
-        else
+    }
+    colorlookup.cellstart[COLOR_CELLS] = (int)count;
+    colorlookup.valid = true;
+}
+
+static inline byte nearest_color(int r, int g, int b)
+{
+    int cell = ((r >> COLOR_CELL_SHIFT) << (2 * COLOR_CELL_BITS)) |
+               ((g >> COLOR_CELL_SHIFT) << COLOR_CELL_BITS) |
+               (b >> COLOR_CELL_SHIFT);
+    const byte *candidate = colorlookup.candidates + colorlookup.cellstart[cell];
+    const byte *end = colorlookup.candidates + colorlookup.cellstart[cell + 1];
+    int best_match = *candidate;
+    int best_distance = 999999;
+
+    for (; candidate < end; candidate++)
+    {
+        const byte *entry = colorlookup.palette + *candidate * 3;
+        int dr = r - entry[0];
+        int dg = g - entry[1];
+        int db = b - entry[2];
+        int distance = dr * dr + dg * dg + db * db;
+
+        if (distance < best_distance)
         {
-            memcpy(lbmpalette, original_palette, PALETTE_SIZE * 3);
+            best_distance = distance;
+            best_match = *candidate;
         }
     }
-    else
+
+    return (byte)best_match;
+}
+
+static void set_fixed_palette(const char *filename)
+{
+    if (!fixed_palette)
+        fixed_palette = safe_malloc(PALETTE_SIZE * 3);
+    const char *problem = load_palette_file(filename, fixed_palette);
+    if (problem)
+        error("%s: %s", filename, problem);
+    build_color_lookup(fixed_palette, PALETTE_SIZE);
+}
+
+static int read_le16(const byte *p)
+{
+    return (short)(p[0] | (p[1] << 8));
+}
+
+static int read_le32(const byte *p)
+{
+    return (int)((unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24));
+}
+
+static byte *read_file_data(FILE *f, size_t *size)
+{
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (length < 0)
+        return NULL;
+
+    byte *data = safe_malloc(length ? length : 1);
+    if (fread(data, 1, length, f) != (size_t)length)
     {
-        if (!palette_established)
-        {
-            fseek(f, data_offset, SEEK_SET);
-            int row_size = ((width * bpp + 31) / 32) * 4;
-            byte *row_buffer = safe_malloc(row_size);
+        free(data);
+        return NULL;
+    }
 
-            typedef struct
-            {
-                byte r, g, b;
-            } color_t;
-            color_t *unique_colors = safe_malloc(PALETTE_SIZE * sizeof(color_t));
-            int palette_index = 0;
+    *size = length;
+    return data;
+}
 
-            for (int y = height - 1; y >= 0 && palette_index < 256; y--)
-            {
-                if (fread(row_buffer, 1, row_size, f) != (size_t)row_size)
-                {
-                    memset(row_buffer, 0, row_size);
-                }
+/*
+ * Read-only file mapping. Archives are mapped once and their entries are
+ * decoded straight out of the mapping.
+ */
+static byte *map_file(const char *path, size_t *size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER length;
+    if (!GetFileSizeEx(file, &length) || length.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
 
-                for (int x = 0; x < width && palette_index < PALETTE_SIZE; x++)
-                {
-                    byte r, g, b;
-                    if (bpp == 24)
-                    {
-                        b = row_buffer[x * 3];
-                        g = row_buffer[x * 3 + 1];
-                        r = row_buffer[x * 3 + 2];
-                    }
-                    else if (bpp == 32)
-                    {
-                        b = row_buffer[x * 4];
-                        g = row_buffer[x * 4 + 1];
-                        r = row_buffer[x * 4 + 2];
-                    }
-                    else
-                    {
-                        r = g = b = 0;
-                    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return NULL;
+
+    byte *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+        return NULL;
+
+    *size = (size_t)length.QuadPart;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
 
-                    bool found = false;
-                    for (int i = 0; i < palette_index; i++)
-                    {
-                        if (unique_colors[i].r == r && unique_colors[i].g == g && unique_colors[i].b == b)
-                        {
-                            found = true;
-                            break;
-                        }
-                    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
 
-                    if (!found)
-                    {
-                        unique_colors[palette_index].r = r;
-                        unique_colors[palette_index].g = g;
-                        unique_colors[palette_index].b = b;
-                        lbmpalette[palette_index * 3] = r;
-                        lbmpalette[palette_index * 3 + 1] = g;
-                        lbmpalette[palette_index * 3 + 2] = b;
-                        palette_index++;
-                    }
-                }
-            }
+    *size = st.st_size;
+    return data;
+#endif
+}
 
-            for (int i = palette_index; i < PALETTE_SIZE; i++)
-            {
-                lbmpalette[i * 3] = 0;
-                lbmpalette[i * 3 + 1] = 0;
-                lbmpalette[i * 3 + 2] = 0;
-            }
+static void unmap_file(byte *data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
 
-            if (original_palette)
-                free(original_palette);
-            original_palette = safe_malloc(PALETTE_SIZE * 3);
-            memcpy(original_palette, lbmpalette, PALETTE_SIZE * 3);
-            palette_established = true;
+/*
+ * Archive names are matched against $load and $framefile paths as written
+ * in the script, with backslashes turned into slashes and leading "./" and
+ * "/" dropped.
+ */
+static bool normalize_vfs_name(const char *name, size_t length, char *out, size_t outsize)
+{
+    size_t n = 0;
 
-            free(unique_colors);
-            free(row_buffer);
+    while (length > 0)
+    {
+        if (length >= 2 && name[0] == '.' && (name[1] == '/' || name[1] == '\\'))
+        {
+            name += 2;
+            length -= 2;
+        }
+        else if (name[0] == '/' || name[0] == '\\')
+        {
+            name++;
+            length--;
         }
         else
         {
-            memcpy(lbmpalette, original_palette, PALETTE_SIZE * 3);
+            break;
         }
     }
 
-    fseek(f, data_offset, SEEK_SET);
-
-    int row_size = ((width * bpp + 31) / 32) * 4;
-    byte *row_buffer = safe_malloc(row_size);
+    if (length == 0 || length >= outsize)
+        return false;
 
-    if (byteimage)
-        free(byteimage);
-    byteimage = safe_malloc(width * height);
+    for (; n < length && name[n]; n++)
+        out[n] = name[n] == '\\' ? '/' : name[n];
+    out[n] = 0;
+    return true;
+}
 
-    for (int y = height - 1; y >= 0; y--)
+static unsigned vfs_hash(const char *name)
+{
+    unsigned hash = 2166136261u;
+    while (*name)
     {
-        if (fread(row_buffer, 1, row_size, f) != (size_t)row_size)
-        {
-            memset(row_buffer, 0, row_size);
-        }
+        hash ^= (byte)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-        for (int x = 0; x < width; x++)
-        {
-            if (bpp == 8)
-            {
-                byteimage[y * width + x] = row_buffer[x];
-            }
-            else if (bpp == 24)
-            {
-                byte b = row_buffer[x * 3];
-                byte g = row_buffer[x * 3 + 1];
-                byte r = row_buffer[x * 3 + 2];
+static void vfs_add_entry(vfsarchive_t *archive, const char *name, size_t namelength, size_t offset, size_t size)
+{
+    char normalized[MAX_PATH_SIZE];
 
-                int best_match = 0;
-                int best_distance = 999999;
+    if (!normalize_vfs_name(name, namelength, normalized, sizeof(normalized)))
+        return;
 
-                for (int i = 0; i < PALETTE_SIZE; i++)
-                {
-                    int dr = r - lbmpalette[i * 3];
-                    int dg = g - lbmpalette[i * 3 + 1];
-                    int db = b - lbmpalette[i * 3 + 2];
-                    int distance = dr * dr + dg * dg + db * db;
+    if (archive->numentries == archive->maxentries)
+    {
+        archive->maxentries = archive->maxentries ? archive->maxentries * 2 : 256;
+        archive->entries = safe_realloc(archive->entries, archive->maxentries * sizeof(vfsentry_t));
+    }
 
-                    if (distance < best_distance)
-                    {
-                        best_distance = distance;
-                        best_match = i;
-                    }
+    vfsentry_t *entry = &archive->entries[archive->numentries++];
+    entry->name = safe_malloc(strlen(normalized) + 1);
+    strcpy(entry->name, normalized);
+    entry->offset = offset;
+    entry->size = size;
+}
+
+static size_t parse_tar_number(const byte *field, int length)
+{
+    size_t value = 0;
+
+    /* GNU base-256 encoding for sizes that do not fit in octal */
+    if (field[0] & 0x80)
+    {
+        value = field[0] & 0x7f;
+        for (int i = 1; i < length; i++)
+            value = (value << 8) | field[i];
+        return value;
+    }
+
+    for (int i = 0; i < length && field[i]; i++)
+    {
+        if (field[i] >= '0' && field[i] <= '7')
+            value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+static void index_tar(vfsarchive_t *archive)
+{
+    const byte *data = archive->data;
+    size_t size = archive->size;
+    size_t pos = 0;
+    char *longname = NULL;
+    size_t longnamelength = 0;
+
+    while (pos + 512 <= size)
+    {
+        const byte *header = data + pos;
+
+        if (!header[0])
+            break;
+
+        size_t entrysize = parse_tar_number(header + 124, 12);
+        size_t dataoffset = pos + 512;
+        byte type = header[156];
+
+        if (dataoffset + entrysize > size)
+            error("%s: truncated tar entry", archive->path);
+
+        if (type == 'L')
+        {
+            /* GNU long name for the next entry */
+            free(longname);
+            longname = safe_malloc(entrysize + 1);
+            memcpy(longname, data + dataoffset, entrysize);
+            longname[entrysize] = 0;
+            longnamelength = strlen(longname);
+        }
+        else if (type == 'x')
+        {
+            /* pax extended header, only the path record matters here */
+            const char *record = (const char *)data + dataoffset;
+            const char *end = record + entrysize;
+
+            while (record < end)
+            {
+                char *space;
+                long recordlength = strtol(record, &space, 10);
+                if (recordlength <= 0 || record + recordlength > end || *space != ' ')
+                    break;
+                if (!strncmp(space + 1, "path=", 5))
+                {
+                    const char *value = space + 6;
+                    free(longname);
+                    longnamelength = record + recordlength - 1 - value;
+                    longname = safe_malloc(longnamelength + 1);
+                    memcpy(longname, value, longnamelength);
+                    longname[longnamelength] = 0;
+                }
+                record += recordlength;
+            }
+        }
+        else if (type == '0' || type == 0 || type == '7')
+        {
+            if (longname)
+            {
+                vfs_add_entry(archive, longname, longnamelength, dataoffset, entrysize);
+            }
+            else
+            {
+                char name[256 + 1];
+                size_t length = 0;
+
+                /* only POSIX ustar has a name prefix; old GNU headers keep times there */
+                if (!memcmp(header + 257, "ustar\0", 6) && header[345])
+                {
+                    length = strnlen((const char *)header + 345, 155);
+                    memcpy(name, header + 345, length);
+                    name[length++] = '/';
+                }
+                size_t namelength = strnlen((const char *)header, 100);
+                memcpy(name + length, header, namelength);
+                length += namelength;
+                name[length] = 0;
+
+                vfs_add_entry(archive, name, length, dataoffset, entrysize);
+            }
+        }
+
+        if (type != 'L' && type != 'x' && type != 'g')
+        {
+            free(longname);
+            longname = NULL;
+        }
+
+        pos = dataoffset + ((entrysize + 511) & ~(size_t)511);
+    }
+
+    free(longname);
+}
+
+static void index_zip(vfsarchive_t *archive)
+{
+    const byte *data = archive->data;
+    size_t size = archive->size;
+    size_t eocd = 0;
+    bool found = false;
+    int skipped = 0;
+
+    if (size < 22)
+        error("%s: not a zip archive", archive->path);
+
+    for (size_t pos = size - 22;; pos--)
+    {
+        if (read_le32(data + pos) == 0x06054b50)
+        {
+            eocd = pos;
+            found = true;
+            break;
+        }
+        if (pos == 0 || size - pos > 22 + 0xffff)
+            break;
+    }
+    if (!found)
+        error("%s: zip end of central directory not found", archive->path);
+
+    int count = read_le16(data + eocd + 10) & 0xffff;
+    size_t pos = (unsigned)read_le32(data + eocd + 16);
+
+    if ((unsigned)read_le32(data + eocd + 16) == 0xffffffffu)
+        error("%s: zip64 archives are not supported", archive->path);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (pos + 46 > size || read_le32(data + pos) != 0x02014b50)
+            error("%s: bad zip central directory", archive->path);
+
+        int method = read_le16(data + pos + 10) & 0xffff;
+        size_t compressed = (unsigned)read_le32(data + pos + 20);
+        size_t namelength = read_le16(data + pos + 28) & 0xffff;
+        size_t extralength = read_le16(data + pos + 30) & 0xffff;
+        size_t commentlength = read_le16(data + pos + 32) & 0xffff;
+        size_t local = (unsigned)read_le32(data + pos + 42);
+        const char *name = (const char *)data + pos + 46;
+
+        pos += 46 + namelength + extralength + commentlength;
+
+        if (namelength && name[namelength - 1] == '/')
+            continue;
+
+        if (method != 0)
+        {
+            skipped++;
+            continue;
+        }
+
+        if (local + 30 > size || read_le32(data + local) != 0x04034b50)
+            error("%s: bad zip local header", archive->path);
+
+        size_t dataoffset = local + 30 + (read_le16(data + local + 26) & 0xffff) +
+                            (read_le16(data + local + 28) & 0xffff);
+        if (dataoffset + compressed > size)
+            error("%s: truncated zip entry", archive->path);
+
+        vfs_add_entry(archive, name, namelength, dataoffset, compressed);
+    }
+
+    if (skipped)
+        fprintf(stderr, "Warning: %s: %d compressed entr%s skipped, only stored entries are mounted\n",
+                archive->path, skipped, skipped == 1 ? "y" : "ies");
+}
+
+static void mount_archive(const char *path)
+{
+    archives = safe_realloc(archives, (numarchives + 1) * sizeof(vfsarchive_t));
+    vfsarchive_t *archive = &archives[numarchives];
+    memset(archive, 0, sizeof(*archive));
+
+    archive->path = safe_malloc(strlen(path) + 1);
+    strcpy(archive->path, path);
+    archive->data = map_file(path, &archive->size);
+    if (!archive->data)
+        error("Could not map %s", path);
+
+    if (archive->size >= 4 && read_le32(archive->data) == 0x04034b50)
+        index_zip(archive);
+    else if (archive->size >= 22 && read_le32(archive->data + archive->size - 22) == 0x06054b50)
+        index_zip(archive);
+    else if (archive->size >= 512 && !memcmp(archive->data + 257, "ustar", 5))
+        index_tar(archive);
+    else
+        error("%s is neither a tar nor a zip archive", path);
+
+    archive->hashsize = 16;
+    while (archive->hashsize < archive->numentries * 2)
+        archive->hashsize *= 2;
+    archive->hash = safe_malloc(archive->hashsize * sizeof(int));
+    for (int i = 0; i < archive->hashsize; i++)
+        archive->hash[i] = -1;
+
+    for (int i = 0; i < archive->numentries; i++)
+    {
+        unsigned slot = vfs_hash(archive->entries[i].name) & (archive->hashsize - 1);
+        while (archive->hash[slot] >= 0 && strcmp(archive->entries[archive->hash[slot]].name, archive->entries[i].name))
+            slot = (slot + 1) & (archive->hashsize - 1);
+        /* a later copy of the same name replaces the earlier one, as tar does */
+        archive->hash[slot] = i;
+    }
+
+    vfs_bytes_mapped += archive->size;
+    numarchives++;
+}
+
+static void unmount_archives(void)
+{
+    for (int i = 0; i < numarchives; i++)
+    {
+        vfsarchive_t *archive = &archives[i];
+        for (int j = 0; j < archive->numentries; j++)
+            free(archive->entries[j].name);
+        free(archive->entries);
+        free(archive->hash);
+        unmap_file(archive->data, archive->size);
+        free(archive->path);
+    }
+    free(archives);
+    archives = NULL;
+    numarchives = 0;
+}
+
+/*
+ * Finds a relative $load path in the mounted archives, earliest mount
+ * first. The returned bytes point into the archive mapping.
+ */
+static const byte *vfs_lookup(const char *name, size_t *size)
+{
+    char normalized[MAX_PATH_SIZE];
+
+    if (!numarchives || is_absolute_path(name) ||
+        !normalize_vfs_name(name, strlen(name), normalized, sizeof(normalized)))
+        return NULL;
+
+    unsigned hash = vfs_hash(normalized);
+    for (int i = 0; i < numarchives; i++)
+    {
+        const vfsarchive_t *archive = &archives[i];
+        unsigned slot = hash & (archive->hashsize - 1);
+
+        while (archive->hash[slot] >= 0)
+        {
+            const vfsentry_t *entry = &archive->entries[archive->hash[slot]];
+            if (!strcmp(entry->name, normalized))
+            {
+                *size = entry->size;
+                return archive->data + entry->offset;
+            }
+            slot = (slot + 1) & (archive->hashsize - 1);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Expands BI_RLE8 or BI_RLE4 pixel data into 8-bit indices. Rows arrive
+ * bottom-up; pixels skipped by deltas or early line ends stay index 0.
+ */
+static const char *decode_bmp_rle(const byte *src, size_t length, bool rle4, bmpimage_t *image)
+{
+    int width = image->width;
+    int height = image->height;
+    const byte *end = src + length;
+    int x = 0, y = height - 1;
+
+    memset(image->pixels, 0, (size_t)width * height);
+
+    while (src + 2 <= end)
+    {
+        int count = src[0];
+        int value = src[1];
+        src += 2;
+
+        if (count)
+        {
+            /* encoded run */
+            if (y < 0 || x + count > width)
+                return "RLE run overflows the image";
+            byte *dest = image->pixels + (size_t)y * width + x;
+            if (!rle4)
+            {
+                memset(dest, value, count);
+            }
+            else
+            {
+                for (int i = 0; i < count; i++)
+                    dest[i] = i & 1 ? value & 15 : value >> 4;
+            }
+            x += count;
+            continue;
+        }
+
+        if (value == 0)
+        {
+            x = 0;
+            y--;
+        }
+        else if (value == 1)
+        {
+            return NULL;
+        }
+        else if (value == 2)
+        {
+            if (src + 2 > end)
+                break;
+            x += src[0];
+            y -= src[1];
+            src += 2;
+            if (x > width)
+                return "RLE delta leaves the image";
+        }
+        else
+        {
+            /* absolute run, padded to a 16-bit boundary */
+            size_t bytes = rle4 ? ((size_t)value + 1) / 2 : (size_t)value;
+            if ((size_t)(end - src) < bytes)
+                break;
+            if (y < 0 || x + value > width)
+                return "RLE run overflows the image";
+            byte *dest = image->pixels + (size_t)y * width + x;
+            if (!rle4)
+            {
+                memcpy(dest, src, value);
+            }
+            else
+            {
+                for (int i = 0; i < value; i++)
+                    dest[i] = i & 1 ? src[i >> 1] & 15 : src[i >> 1] >> 4;
+            }
+            x += value;
+            src += (bytes + 1) & ~(size_t)1;
+        }
+    }
+
+    /* a missing end-of-bitmap marker is tolerated, like most readers do */
+    return NULL;
+}
+
+/* Position and width of a BI_BITFIELDS channel mask, which must be 8 bits wide. */
+static bool mask_shift(uint32_t mask, int *shift)
+{
+    if (!mask)
+    {
+        *shift = -1;
+        return true;
+    }
+
+    int s = 0;
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        s++;
+    }
+    *shift = s;
+    return mask == 0xff;
+}
+
+/*
+ * Reads and checks the file and info headers. The info header may be any
+ * of the Windows versions from BITMAPINFOHEADER up to BITMAPV5HEADER, and
+ * a negative height marks a top-down file. Only the first bytes of the
+ * file are needed, so --plan can call it on a partial read. Returns NULL
+ * on success or a description of the problem.
+ */
+static const char *read_bmp_header(const byte *data, size_t size, bmpheader_t *header)
+{
+    if (size < 54)
+        return "truncated BMP header";
+
+    if (data[0] != 'B' || data[1] != 'M')
+        return "not a valid BMP file";
+
+    header->header_size = read_le32(data + 14);
+    header->width = read_le32(data + 18);
+    header->height = read_le32(data + 22);
+    header->bpp = read_le16(data + 28);
+    header->compression = read_le32(data + 30);
+    header->data_offset = read_le32(data + 10);
+    header->colors_used = read_le32(data + 46);
+    header->topdown = false;
+
+    if (header->header_size < 40 || (size_t)header->header_size > size - 14)
+        return "unsupported BMP header";
+
+    if (header->height < 0 && header->height != INT_MIN)
+    {
+        header->topdown = true;
+        header->height = -header->height;
+    }
+
+    if (header->width <= 0 || header->height <= 0)
+        return "invalid dimensions";
+
+    int bpp = header->bpp;
+    int compression = header->compression;
+    if (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 24 && bpp != 32)
+        return "unsupported bit depth";
+
+    if (!(compression == BI_RGB ||
+          (compression == BI_RLE8 && bpp == 8) ||
+          (compression == BI_RLE4 && bpp == 4) ||
+          (compression == BI_BITFIELDS && bpp == 32)))
+        return "unsupported compression";
+
+    if (header->topdown && (compression == BI_RLE8 || compression == BI_RLE4))
+        return "top-down RLE bitmap";
+
+    /* BI_BITFIELDS masks follow a plain info header, or sit inside V2 and later ones */
+    header->shifts[0] = 16;
+    header->shifts[1] = 8;
+    header->shifts[2] = 0;
+    header->shifts[3] = 24;
+    if (compression == BI_BITFIELDS)
+    {
+        size_t maskoffset = 14 + 40;
+        if (header->header_size == 40)
+        {
+            if (size < maskoffset + 12)
+                return "truncated BMP header";
+        }
+        else if (header->header_size < 52)
+        {
+            return "unsupported BMP header";
+        }
+
+        /* only the alpha mask may be missing, and no two masks may overlap */
+        uint32_t seen = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            uint32_t mask = 0;
+            if (c < 3 || header->header_size >= 56)
+                mask = (uint32_t)read_le32(data + maskoffset + c * 4);
+            if ((c < 3 && !mask) || (mask & seen) || !mask_shift(mask, &header->shifts[c]))
+                return "unsupported bit field masks";
+            seen |= mask;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Unpacks a BMP held in memory into top-down rows: palette indices for
+ * 1, 4 and 8 bpp and RLE images (reported as 8 bpp), BGRA quads for 24
+ * and 32 bpp ones. Returns NULL on success or a description of the
+ * problem. Touches no global state, so prefetch workers can run it.
+ */
+static const char *decode_bmp(const byte *data, size_t size, bmpimage_t *image)
+{
+    bmpheader_t header;
+    const char *problem = read_bmp_header(data, size, &header);
+
+    if (problem)
+        return problem;
+
+    int header_size = header.header_size;
+    int width = header.width;
+    int height = header.height;
+    int bpp = header.bpp;
+    int compression = header.compression;
+    int data_offset = header.data_offset;
+    int colors_used = header.colors_used;
+    bool topdown = header.topdown;
+    const int *shifts = header.shifts;
+
+    image->width = width;
+    image->height = height;
+    image->bpp = bpp <= 8 ? 8 : bpp;
+    memset(image->palette, 0, sizeof(image->palette));
+
+    if (bpp <= 8)
+    {
+        size_t palette_offset = 14 + (size_t)header_size;
+        int palette_colors = colors_used ? colors_used : 1 << bpp;
+        if (palette_colors > PALETTE_SIZE)
+            palette_colors = PALETTE_SIZE;
+
+        for (int i = 0; i < palette_colors && palette_offset + (size_t)(i + 1) * 4 <= size; i++)
+        {
+            const byte *bgra = data + palette_offset + i * 4;
+            image->palette[i * 3] = bgra[2];
+            image->palette[i * 3 + 1] = bgra[1];
+            image->palette[i * 3 + 2] = bgra[0];
+        }
+    }
+
+    size_t pixel_size = image->bpp == 8 ? 1 : 4;
+    image->pixels = safe_malloc((size_t)width * height * pixel_size);
+
+    if (compression == BI_RLE8 || compression == BI_RLE4)
+    {
+        if (data_offset < 0 || (size_t)data_offset > size)
+            return "truncated RLE data";
+
+        const char *problem = decode_bmp_rle(data + data_offset, size - data_offset, compression == BI_RLE4, image);
+        if (problem)
+        {
+            free(image->pixels);
+            image->pixels = NULL;
+        }
+        return problem;
+    }
+
+    size_t row_size = (((size_t)width * bpp + 31) / 32) * 4;
+    byte alphabits = 0;
+
+    for (int y = 0; y < height; y++)
+    {
+        size_t offset = data_offset + (size_t)(topdown ? y : height - 1 - y) * row_size;
+        byte *dest = image->pixels + (size_t)y * width * pixel_size;
+
+        if (data_offset < 0 || offset + row_size > size)
+        {
+            memset(dest, 0, width * pixel_size);
+            if (bpp > 8)
+            {
+                for (int x = 0; x < width; x++)
+                    dest[x * 4 + 3] = 255;
+            }
+            continue;
+        }
+
+        const byte *row = data + offset;
+        if (bpp == 8)
+        {
+            memcpy(dest, row, width);
+        }
+        else if (bpp == 4)
+        {
+            for (int x = 0; x < width; x++)
+                dest[x] = x & 1 ? row[x >> 1] & 15 : row[x >> 1] >> 4;
+        }
+        else if (bpp == 1)
+        {
+            for (int x = 0; x < width; x++)
+                dest[x] = (row[x >> 3] >> (7 - (x & 7))) & 1;
+        }
+        else if (bpp == 24)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                dest[x * 4] = row[x * 3];
+                dest[x * 4 + 1] = row[x * 3 + 1];
+                dest[x * 4 + 2] = row[x * 3 + 2];
+                dest[x * 4 + 3] = 255;
+            }
+        }
+        else if (compression == BI_BITFIELDS)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                uint32_t pixel = (uint32_t)read_le32(row + x * 4);
+                dest[x * 4] = (byte)(pixel >> shifts[2]);
+                dest[x * 4 + 1] = (byte)(pixel >> shifts[1]);
+                dest[x * 4 + 2] = (byte)(pixel >> shifts[0]);
+                dest[x * 4 + 3] = shifts[3] < 0 ? 255 : (byte)(pixel >> shifts[3]);
+            }
+        }
+        else
+        {
+            memcpy(dest, row, (size_t)width * 4);
+            for (int x = 0; x < width; x++)
+                alphabits |= dest[x * 4 + 3];
+        }
+    }
+
+    /*
+     * Most writers leave the fourth byte of BI_RGB pixels at zero. An
+     * alpha channel that is zero everywhere is unused, not a fully
+     * transparent image, so treat it like a missing alpha mask.
+     */
+    if (bpp == 32 && compression == BI_RGB && !alphabits)
+    {
+        for (size_t i = 3; i < (size_t)width * height * 4; i += 4)
+            image->pixels[i] = 255;
+    }
+
+    return NULL;
+}
+
+/*
+ * Loads and decodes a $load or $framefile image, from a mounted archive
+ * when one holds it and from disk otherwise. Returns the number of bytes
+ * taken from an archive, 0 for a plain file.
+ */
+static size_t read_bmp(const char *name, const char *path, bmpimage_t *image)
+{
+    size_t size;
+    const byte *entry = vfs_lookup(name, &size);
+    const char *problem;
+
+    if (entry)
+    {
+        problem = decode_bmp(entry, size, image);
+    }
+    else
+    {
+        FILE *f = safe_open_read(path);
+        byte *data = read_file_data(f, &size);
+        fclose(f);
+
+        if (!data)
+            error("File read failure");
+
+        problem = decode_bmp(data, size, image);
+        free(data);
+        size = 0;
+    }
+
+    if (problem)
+        error("%s: %s", path, problem);
+
+    return size;
+}
+
+/*
+ * read_bmp for worker threads: nothing is reported, it just returns false
+ * when the image cannot be read or decoded. The caller then retries with
+ * read_bmp on its own thread to report why.
+ */
+static bool try_read_bmp(const char *name, const char *path, bmpimage_t *image, size_t *archivebytes)
+{
+    size_t size;
+    const byte *entry = vfs_lookup(name, &size);
+    bool ok = false;
+
+    image->pixels = NULL;
+    *archivebytes = 0;
+
+    if (entry)
+    {
+        ok = decode_bmp(entry, size, image) == NULL;
+        *archivebytes = size;
+    }
+    else
+    {
+        FILE *f = fopen(path, "rb");
+        if (f)
+        {
+            byte *data = read_file_data(f, &size);
+            fclose(f);
+
+            if (data)
+            {
+                ok = decode_bmp(data, size, image) == NULL;
+                free(data);
+            }
+        }
+    }
+
+    return ok;
+}
+
+/*
+ * Derives a palette from the first PALETTE_SIZE distinct colors of a
+ * truecolor image, scanning rows in file (bottom-up) order. When keyed,
+ * pixels below the alpha threshold are skipped and the last entry is kept
+ * back as the transparent color.
+ */
+static void derive_palette(const bmpimage_t *image, byte *palette, bool keyed)
+{
+    int palette_index = 0;
+    int limit = keyed ? TRANSPARENT_INDEX : PALETTE_SIZE;
+
+    memset(palette, 0, PALETTE_SIZE * 3);
+    if (keyed)
+        palette[TRANSPARENT_INDEX * 3 + 2] = 255;
+
+    for (int y = image->height - 1; y >= 0 && palette_index < limit; y--)
+    {
+        const byte *row = image->pixels + (size_t)y * image->width * 4;
+
+        for (int x = 0; x < image->width && palette_index < limit; x++)
+        {
+            if (keyed && row[x * 4 + 3] < alpha_threshold)
+                continue;
+
+            byte b = row[x * 4];
+            byte g = row[x * 4 + 1];
+            byte r = row[x * 4 + 2];
+
+            bool found = false;
+            for (int i = 0; i < palette_index; i++)
+            {
+                if (palette[i * 3] == r && palette[i * 3 + 1] == g && palette[i * 3 + 2] == b)
+                {
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found)
+            {
+                palette[palette_index * 3] = r;
+                palette[palette_index * 3 + 1] = g;
+                palette[palette_index * 3 + 2] = b;
+                palette_index++;
+            }
+        }
+    }
+}
+
+static void establish_palette(const byte *palette)
+{
+    if (original_palette)
+        free(original_palette);
+    original_palette = safe_malloc(PALETTE_SIZE * 3);
+    memcpy(original_palette, palette, PALETTE_SIZE * 3);
+    palette_established = true;
+}
+
+static inline int clamp_channel(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline uint32_t pixel_error(const byte *bgra, const byte *color)
+{
+    int dr = abs(bgra[2] - color[0]);
+    int dg = abs(bgra[1] - color[1]);
+    int db = abs(bgra[0] - color[2]);
+    int maxerror = dr > dg ? (dr > db ? dr : db) : (dg > db ? dg : db);
+
+    return ((uint32_t)maxerror << 24) | (uint32_t)(dr * dr + dg * dg + db * db);
+}
+
+/*
+ * Adds the error of count converted pixels to sum: each source pixel
+ * against the palette color its index shows. Keyed pixels below the alpha
+ * threshold carry no color and are left out.
+ */
+static void accumulate_error(qualitysum_t *sum, const byte *bgra, const byte *indices, int count,
+                             const byte *palette, bool keyed)
+{
+    for (int x = 0; x < count; x++, bgra += 4)
+    {
+        if (keyed && bgra[3] < alpha_threshold)
+            continue;
+
+        const byte *color = palette + indices[x] * 3;
+        int dr = abs(bgra[2] - color[0]);
+        int dg = abs(bgra[1] - color[1]);
+        int db = abs(bgra[0] - color[2]);
+        int maxerror = dr > dg ? (dr > db ? dr : db) : (dg > db ? dg : db);
+
+        sum->pixels++;
+        sum->sumsq += dr * dr + dg * dg + db * db;
+        if (maxerror > sum->maxerror)
+            sum->maxerror = maxerror;
+    }
+}
+
+/*
+ * Per-byte saturating add and subtract on eight bytes at once. The low
+ * seven bits are summed without crossing lanes, bit 7 is fixed up
+ * separately, and lanes that overflowed are filled with 0xff (or 0).
+ */
+static inline uint64_t add_saturate8(uint64_t a, uint64_t b)
+{
+    const uint64_t high = 0x8080808080808080ull;
+    uint64_t sum = ((a & ~high) + (b & ~high)) ^ ((a ^ b) & high);
+    uint64_t carry = ((a & b) | ((a | b) & ~sum)) & high;
+
+    return sum | ((carry >> 7) * 0xff);
+}
+
+static inline uint64_t subtract_saturate8(uint64_t a, uint64_t b)
+{
+    const uint64_t high = 0x8080808080808080ull;
+    uint64_t diff = ((a | high) - (b & ~high)) ^ ((a ^ ~b) & high);
+    uint64_t borrow = ((~a & b) | (~(a ^ b) & diff)) & high;
+
+    return diff & ~((borrow >> 7) * 0xff);
+}
+
+/* Adds per-index pixel counts weighted by a table of packed pixel_error words. */
+static void add_index_errors(qualitysum_t *sum, const uint64_t *counts, const uint32_t *errors)
+{
+    for (int i = 0; i < PALETTE_SIZE; i++)
+    {
+        if (!counts[i] || errors[i] == QUALITY_EXCLUDED)
+            continue;
+        sum->pixels += counts[i];
+        sum->sumsq += counts[i] * (errors[i] & 0xffffff);
+        if ((int)(errors[i] >> 24) > sum->maxerror)
+            sum->maxerror = errors[i] >> 24;
+    }
+}
+
+static void merge_quality(qualitysum_t *total, const qualitysum_t *part, pthread_mutex_t *lock)
+{
+    pthread_mutex_lock(lock);
+    total->pixels += part->pixels;
+    total->sumsq += part->sumsq;
+    if (part->maxerror > total->maxerror)
+        total->maxerror = part->maxerror;
+    pthread_mutex_unlock(lock);
+}
+
+static inline int bayer_offset(int y, int x)
+{
+    return ((bayer8[(y & 7) * 8 + (x & 7)] * 2 - 63) * DITHER_SPREAD) / 128;
+}
+
+/*
+ * Ordered dithering: rows are independent, so they are split across
+ * workers. The Bayer offset-and-clamp step runs two pixels per 64-bit
+ * word: the offsets of a row repeat every eight pixels, so they are split
+ * by sign into four raise and four lower words (alpha bytes get 0) and
+ * applied with saturating arithmetic. Only the palette lookup stays per
+ * pixel.
+ */
+static void dither_ordered_rows(void *arg, int begin, int end)
+{
+    ditherjob_t *job = arg;
+    int width = job->image->width;
+    byte *adjusted = safe_malloc((size_t)width * 4);
+    qualitysum_t sum = {0, 0, 0};
+
+    for (int y = begin; y < end; y++)
+    {
+        const byte *source = job->image->pixels + (size_t)y * width * 4;
+        byte *dest = job->dest + (size_t)y * width;
+        byte raise[32], lower[32];
+        uint64_t raisewords[4], lowerwords[4];
+
+        memset(raise, 0, sizeof(raise));
+        memset(lower, 0, sizeof(lower));
+        for (int x = 0; x < 8; x++)
+        {
+            int offset = bayer_offset(y, x);
+            memset((offset > 0 ? raise : lower) + x * 4, offset > 0 ? offset : -offset, 3);
+        }
+        memcpy(raisewords, raise, sizeof(raise));
+        memcpy(lowerwords, lower, sizeof(lower));
+
+        int x = 0;
+        for (; x + 2 <= width; x += 2)
+        {
+            uint64_t pair;
+            memcpy(&pair, source + x * 4, 8);
+            pair = subtract_saturate8(add_saturate8(pair, raisewords[(x >> 1) & 3]), lowerwords[(x >> 1) & 3]);
+            memcpy(adjusted + x * 4, &pair, 8);
+        }
+        for (; x < width; x++)
+        {
+            int offset = bayer_offset(y, x);
+            for (int c = 0; c < 3; c++)
+                adjusted[x * 4 + c] = clamp_channel(source[x * 4 + c] + offset);
+            adjusted[x * 4 + 3] = source[x * 4 + 3];
+        }
+
+        const byte *bgra = adjusted;
+        for (x = 0; x < width; x++, bgra += 4)
+        {
+            if (job->keyed && bgra[3] < alpha_threshold)
+                dest[x] = TRANSPARENT_INDEX;
+            else
+                dest[x] = nearest_color(bgra[2], bgra[1], bgra[0]);
+        }
+
+        /* error is measured against the source, not the dithered color */
+        if (job->quality)
+            accumulate_error(&sum, source, dest, width, colorlookup.palette, job->keyed);
+    }
+
+    if (job->quality)
+        merge_quality(job->quality, &sum, &job->lock);
+    free(adjusted);
+}
+
+static void wait_dither_row(ditherjob_t *job, int y, int blocks)
+{
+    pthread_mutex_lock(&job->lock);
+    while (job->blocksdone[y] < blocks)
+        pthread_cond_wait(&job->progress, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void finish_dither_block(ditherjob_t *job, int y, int blocks)
+{
+    pthread_mutex_lock(&job->lock);
+    job->blocksdone[y] = blocks;
+    pthread_cond_broadcast(&job->progress);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Floyd-Steinberg as a wavefront: lane l runs rows l, l + lanes, ... and a
+ * block of DITHER_BLOCK pixels starts once the row above has finished the
+ * block after it, which is when all error feeding into it has arrived.
+ * Error rows live in a ring of lanes + 2 slots; every slot has one writer
+ * at a time, so the result does not depend on the number of lanes. Within
+ * a row each pixel needs the error carried from the one before it, so
+ * unlike the ordered offsets this loop cannot take two pixels per word.
+ */
+static void dither_fs_lanes(void *arg, int begin, int end)
+{
+    ditherjob_t *job = arg;
+    int width = job->image->width;
+    int height = job->image->height;
+    int numblocks = (width + DITHER_BLOCK - 1) / DITHER_BLOCK;
+    size_t stride = (size_t)(width + 2) * 3;
+    qualitysum_t sum = {0, 0, 0};
+
+    for (int lane = begin; lane < end; lane++)
+    {
+        for (int y = lane; y < height; y += job->lanes)
+        {
+            /* error rows are padded by one pixel on each side */
+            int *current = job->errors + (y % job->ringsize) * stride + 3;
+            int *next = job->errors + ((y + 1) % job->ringsize) * stride + 3;
+            int carry[3] = {0, 0, 0};
+
+            memset(next - 3, 0, stride * sizeof(int));
+
+            for (int block = 0; block < numblocks; block++)
+            {
+                int x0 = block * DITHER_BLOCK;
+                int x1 = x0 + DITHER_BLOCK < width ? x0 + DITHER_BLOCK : width;
+
+                if (y > 0)
+                    wait_dither_row(job, y - 1, block + 2 < numblocks ? block + 2 : numblocks);
+
+                for (int x = x0; x < x1; x++)
+                {
+                    const byte *bgra = job->image->pixels + ((size_t)y * width + x) * 4;
+                    byte *dest = job->dest + (size_t)y * width + x;
+
+                    if (job->keyed && bgra[3] < alpha_threshold)
+                    {
+                        *dest = TRANSPARENT_INDEX;
+                        carry[0] = carry[1] = carry[2] = 0;
+                        continue;
+                    }
+
+                    int want[3];
+                    for (int c = 0; c < 3; c++)
+                        want[c] = clamp_channel(bgra[2 - c] + (current[x * 3 + c] + carry[c]) / 16);
+
+                    *dest = nearest_color(want[0], want[1], want[2]);
+
+                    const byte *got = colorlookup.palette + *dest * 3;
+                    for (int c = 0; c < 3; c++)
+                    {
+                        int err = want[c] - got[c];
+                        carry[c] = err * 7;
+                        next[(x - 1) * 3 + c] += err * 3;
+                        next[x * 3 + c] += err * 5;
+                        next[(x + 1) * 3 + c] += err;
+                    }
+                }
+
+                if (job->quality)
+                {
+                    size_t first = (size_t)y * width + x0;
+                    accumulate_error(&sum, job->image->pixels + first * 4, job->dest + first, x1 - x0,
+                                     colorlookup.palette, job->keyed);
+                }
+                finish_dither_block(job, y, block + 1);
+            }
+        }
+    }
+
+    if (job->quality)
+        merge_quality(job->quality, &sum, &job->lock);
+}
+
+/*
+ * Quantizes a truecolor image into dest against the current color lookup.
+ * nested runs everything on the calling thread, for callers that are
+ * themselves a parallel_for slice.
+ */
+static void dither_image(const bmpimage_t *image, byte *dest, bool keyed, qualitysum_t *quality, bool nested)
+{
+    ditherjob_t job;
+
+    memset(&job, 0, sizeof(job));
+    job.image = image;
+    job.dest = dest;
+    job.keyed = keyed;
+    job.quality = quality;
+
+    if (dither_mode == DITHER_ORDERED)
+    {
+        pthread_mutex_init(&job.lock, NULL);
+        if (nested)
+            dither_ordered_rows(&job, 0, image->height);
+        else
+            parallel_for(image->height, dither_ordered_rows, &job);
+        pthread_mutex_destroy(&job.lock);
+        return;
+    }
+
+    /* one lane per thread; parallel_for hands each slice exactly one */
+    job.lanes = nested ? 1 : numworkers + 1 < image->height ? numworkers + 1 : image->height;
+    job.ringsize = job.lanes + 2;
+    job.errors = safe_malloc((size_t)job.ringsize * (image->width + 2) * 3 * sizeof(int));
+    memset(job.errors, 0, (size_t)job.ringsize * (image->width + 2) * 3 * sizeof(int));
+    job.blocksdone = safe_malloc(image->height * sizeof(int));
+    memset(job.blocksdone, 0, image->height * sizeof(int));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.progress, NULL);
+
+    if (nested)
+        dither_fs_lanes(&job, 0, 1);
+    else
+        parallel_for(job.lanes, dither_fs_lanes, &job);
+
+    pthread_cond_destroy(&job.progress);
+    pthread_mutex_destroy(&job.lock);
+    free(job.blocksdone);
+    free(job.errors);
+}
+
+/*
+ * Picks the palette an image is mapped against and makes it lbmpalette,
+ * establishing the sprite's palette from the first image that needs one.
+ */
+static void select_palette(const bmpimage_t *image)
+{
+    if (!lbmpalette)
+        lbmpalette = safe_malloc(PALETTE_SIZE * 3);
+
+    if (fixed_palette)
+    {
+        memcpy(lbmpalette, fixed_palette, PALETTE_SIZE * 3);
+    }
+    else if (palette_established)
+    {
+        memcpy(lbmpalette, original_palette, PALETTE_SIZE * 3);
+    }
+    else if (image->bpp == 8)
+    {
+        memcpy(lbmpalette, image->palette, PALETTE_SIZE * 3);
+        establish_palette(lbmpalette);
+    }
+    else
+    {
+        if (sprite.texFormat == SPR_INDEXALPHA)
+        {
+            /* the engine tints with the last entry; a gray ramp keeps previews readable */
+            for (int i = 0; i < PALETTE_SIZE; i++)
+                memset(lbmpalette + i * 3, i, 3);
+        }
+        else
+        {
+            derive_palette(image, lbmpalette, sprite.texFormat == SPR_ALPHTEST);
+        }
+        establish_palette(lbmpalette);
+    }
+}
+
+/*
+ * Fills remap with the fixed-palette index for each entry of a paletted
+ * image. Returns false when the image already uses the fixed palette and
+ * its indices can be kept as they are. Indexalpha indices are coverage,
+ * not colors, so they are always kept; for alphatest the key index stays
+ * the key and no opaque color is mapped onto it.
+ */
+static bool build_remap(const bmpimage_t *image, byte *remap)
+{
+    if (!fixed_palette || !memcmp(image->palette, fixed_palette, PALETTE_SIZE * 3) ||
+        sprite.texFormat == SPR_INDEXALPHA)
+        return false;
+
+    bool keyed = sprite.texFormat == SPR_ALPHTEST;
+    int entries = keyed ? TRANSPARENT_INDEX : PALETTE_SIZE;
+
+    build_color_lookup(fixed_palette, entries);
+    for (int i = 0; i < entries; i++)
+    {
+        const byte *c = image->palette + i * 3;
+        if (!memcmp(c, fixed_palette + i * 3, 3))
+            remap[i] = i;
+        else
+            remap[i] = nearest_color(c[0], c[1], c[2]);
+    }
+    if (keyed)
+        remap[TRANSPARENT_INDEX] = TRANSPARENT_INDEX;
+    return true;
+}
+
+/* The lookup convert_image expects to be built for a truecolor image. */
+static void prepare_color_lookup(void)
+{
+    if (sprite.texFormat != SPR_INDEXALPHA)
+        build_color_lookup(lbmpalette, sprite.texFormat == SPR_ALPHTEST ? TRANSPARENT_INDEX : PALETTE_SIZE);
+}
+
+/*
+ * Error per source index of a paletted image: kept indices show
+ * lbmpalette's color, remapped ones the fixed palette's.
+ */
+static void index_errors(const bmpimage_t *image, const byte *remap, uint32_t *errors)
+{
+    for (int i = 0; i < PALETTE_SIZE; i++)
+    {
+        const byte *c = image->palette + i * 3;
+        byte bgra[4] = {c[2], c[1], c[0], 255};
+        errors[i] = pixel_error(bgra, remap ? fixed_palette + remap[i] * 3 : lbmpalette + i * 3);
+    }
+    if (sprite.texFormat == SPR_ALPHTEST)
+        errors[TRANSPARENT_INDEX] = QUALITY_EXCLUDED;
+    else if (sprite.texFormat == SPR_INDEXALPHA)
+        memset(errors, 0xff, PALETTE_SIZE * sizeof(uint32_t));
+}
+
+/* Rows of a truecolor image without dithering; each slice sums its own error. */
+static void convert_rows(void *arg, int begin, int end)
+{
+    convertjob_t *job = arg;
+    int width = job->image->width;
+    qualitysum_t sum = {0, 0, 0};
+
+    for (int y = begin; y < end; y++)
+    {
+        const byte *source = job->image->pixels + (size_t)y * width * 4;
+        const byte *bgra = source;
+        byte *dest = job->dest + (size_t)y * width;
+
+        /*
+         * The alpha key is one compare beside nearest_color. Gathering eight
+         * alphas into a word and testing them with subtract_saturate8 was
+         * slower than this loop, even on long transparent runs.
+         */
+        if (job->keyed)
+        {
+            for (int x = 0; x < width; x++, bgra += 4)
+                dest[x] = bgra[3] < alpha_threshold ? TRANSPARENT_INDEX : nearest_color(bgra[2], bgra[1], bgra[0]);
+        }
+        else
+        {
+            for (int x = 0; x < width; x++, bgra += 4)
+                dest[x] = nearest_color(bgra[2], bgra[1], bgra[0]);
+        }
+
+        /* the row is still in cache; the loops above stay as tight as without a report */
+        if (job->quality)
+            accumulate_error(&sum, source, dest, width, colorlookup.palette, job->keyed);
+    }
+
+    if (job->quality)
+        merge_quality(job->quality, &sum, &job->lock);
+}
+
+/*
+ * Converts a decoded image into palette indices at dest, which may be the
+ * image's own pixel buffer for a paletted source. remap comes from
+ * build_remap (NULL to keep indices) and truecolor images need
+ * prepare_color_lookup first. The image's error is added to quality when
+ * it is not NULL. Only reads shared state, so $framefile runs it on worker
+ * threads; nested keeps the conversion off the pool there.
+ */
+static void convert_image(const bmpimage_t *image, const byte *remap, byte *dest, qualitysum_t *quality, bool nested)
+{
+    size_t numpixels = (size_t)image->width * image->height;
+
+    if (image->bpp == 8)
+    {
+        const byte *source = image->pixels;
+
+        /* the error is known per source index, so counting the indices is enough */
+        if (quality)
+        {
+            uint32_t errors[PALETTE_SIZE];
+            uint64_t counts[PALETTE_SIZE];
+
+            memset(counts, 0, sizeof(counts));
+            if (remap)
+            {
+                for (size_t i = 0; i < numpixels; i++)
+                {
+                    counts[source[i]]++;
+                    dest[i] = remap[source[i]];
                 }
+            }
+            else
+            {
+                for (size_t i = 0; i < numpixels; i++)
+                    counts[source[i]]++;
+                if (dest != source)
+                    memcpy(dest, source, numpixels);
+            }
+
+            index_errors(image, remap, errors);
+            add_index_errors(quality, counts, errors);
+            return;
+        }
+
+        if (remap)
+        {
+            for (size_t i = 0; i < numpixels; i++)
+                dest[i] = remap[source[i]];
+        }
+        else if (dest != source)
+        {
+            memcpy(dest, source, numpixels);
+        }
+        return;
+    }
+
+    bool keyed = sprite.texFormat == SPR_ALPHTEST;
+    const byte *bgra = image->pixels;
+
+    if (sprite.texFormat == SPR_INDEXALPHA)
+    {
+        /*
+         * Indices are coverage: alpha when there is one, luminance otherwise.
+         * The alpha copy already runs at memory speed; packing eight alphas
+         * per 64-bit store did not make it faster.
+         */
+        if (image->bpp == 32)
+        {
+            for (size_t i = 0; i < numpixels; i++, bgra += 4)
+                dest[i] = bgra[3];
+        }
+        else
+        {
+            for (size_t i = 0; i < numpixels; i++, bgra += 4)
+                dest[i] = (byte)((bgra[2] * 77 + bgra[1] * 150 + bgra[0] * 29 + 128) >> 8);
+        }
+        return;
+    }
+
+    if (dither_mode != DITHER_NONE)
+    {
+        dither_image(image, dest, keyed, quality, nested);
+        return;
+    }
+
+    convertjob_t job;
+
+    job.image = image;
+    job.dest = dest;
+    job.keyed = keyed;
+    job.quality = quality;
+    pthread_mutex_init(&job.lock, NULL);
+    if (nested)
+        convert_rows(&job, 0, image->height);
+    else
+        parallel_for(image->height, convert_rows, &job);
+    pthread_mutex_destroy(&job.lock);
+}
+
+/*
+ * Makes a decoded image the current sheet: picks the palette it is mapped
+ * against and converts its pixels into byteimage. With quality, the
+ * sheet's error is added to it and whatever frames need to measure their
+ * own error is kept; the image's pixels may be taken over for that.
+ */
+static void install_bmp(bmpimage_t *image, qualitysum_t *quality)
+{
+    size_t numpixels = (size_t)image->width * image->height;
+    byte remap[PALETTE_SIZE];
+
+    byteimagewidth = image->width;
+    byteimageheight = image->height;
+
+    if (byteimage)
+        free(byteimage);
+    free(qualitypixels);
+    qualitypixels = NULL;
+
+    if (image->bpp == 8)
+    {
+        bool remapped = build_remap(image, remap);
+        select_palette(image);
+
+        if (quality && remapped)
+        {
+            /* frames look up their error by original index, so those stay */
+            byteimage = safe_malloc(numpixels);
+            convert_image(image, remap, byteimage, quality, false);
+            qualitypixels = image->pixels;
+        }
+        else
+        {
+            /* paletted sources are converted in place */
+            convert_image(image, remapped ? remap : NULL, image->pixels, quality, false);
+            byteimage = image->pixels;
+        }
+        image->pixels = NULL;
+
+        if (quality)
+        {
+            qualitytruecolor = false;
+            index_errors(image, remapped ? remap : NULL, qualityerrors);
+        }
+        return;
+    }
+
+    select_palette(image);
+    prepare_color_lookup();
+
+    byteimage = safe_malloc(numpixels);
+    convert_image(image, NULL, byteimage, quality, false);
+
+    if (quality && sprite.texFormat == SPR_INDEXALPHA)
+    {
+        qualitytruecolor = false;
+        memset(qualityerrors, 0xff, sizeof(qualityerrors));
+    }
+    else if (quality)
+    {
+        qualitytruecolor = true;
+        qualitykeyed = sprite.texFormat == SPR_ALPHTEST;
+        memcpy(qualitypalette, colorlookup.palette, sizeof(qualitypalette));
+        qualitypixels = image->pixels;
+        image->pixels = NULL;
+    }
+}
+
+/*
+ * Prefetch stage: a second cursor walks the script ahead of the parser and
+ * hands upcoming $load paths to the worker threads, which read and decode
+ * them into a bounded queue. Palette selection and quantization stay in
+ * load_bmp, since they depend on everything the script did before.
+ */
+static void prefetch_task(void *arg)
+{
+    prefetchjob_t *job = arg;
+
+    job->ok = try_read_bmp(job->name, job->path, &job->image, &job->archivebytes);
+    complete_task(&job->done);
+}
+
+static void prefetch_fill(void)
+{
+    if (!prefetch_enabled || !numworkers)
+        return;
+
+    while (prefetchcount < PREFETCH_DEPTH && parse_token(&prefetchptr, &prefetchtoken, true))
+    {
+        if (strcmp(prefetchtoken.text, "$load"))
+            continue;
+        if (!parse_token(&prefetchptr, &prefetchtoken, false))
+            continue;
+
+        prefetchjob_t *job = &prefetchqueue[(prefetchhead + prefetchcount) % PREFETCH_DEPTH];
+        job->name = safe_malloc(strlen(prefetchtoken.text) + 1);
+        strcpy(job->name, prefetchtoken.text);
+        job->path = resolve_path(prefetchtoken.text);
+        job->done = false;
+        prefetchcount++;
+
+        submit_task(prefetch_task, job);
+    }
+}
+
+static void prefetch_drain(void)
+{
+    while (prefetchcount > 0)
+    {
+        prefetchjob_t *job = &prefetchqueue[prefetchhead];
+
+        wait_task(&job->done);
+        free(job->image.pixels);
+        free(job->name);
+        free(job->path);
+
+        prefetchhead = (prefetchhead + 1) % PREFETCH_DEPTH;
+        prefetchcount--;
+    }
+}
+
+static bool prefetch_take(const char *path, bmpimage_t *image, size_t *archivebytes)
+{
+    if (!prefetchcount)
+        return false;
+
+    prefetchjob_t *job = &prefetchqueue[prefetchhead];
+
+    if (strcmp(job->path, path))
+    {
+        /* the scanner lost track of the parser; restart it from here */
+        prefetch_drain();
+        prefetchptr = scriptptr;
+        return false;
+    }
+
+    wait_task(&job->done);
+    free(job->name);
+    free(job->path);
+
+    prefetchhead = (prefetchhead + 1) % PREFETCH_DEPTH;
+    prefetchcount--;
+
+    if (!job->ok)
+        return false;
+
+    *image = job->image;
+    *archivebytes = job->archivebytes;
+    return true;
+}
+
+/* Returns the index of the new sheet entry. */
+static int note_sheet_quality(const char *name, int width, int height, const qualitysum_t *sum)
+{
+    if (numqualitysheets == maxqualitysheets)
+    {
+        maxqualitysheets = maxqualitysheets ? maxqualitysheets * 2 : 16;
+        qualitysheets = safe_realloc(qualitysheets, maxqualitysheets * sizeof(qualitysheet_t));
+    }
+
+    qualitysheet_t *sheet = &qualitysheets[numqualitysheets++];
+    sheet->name = safe_malloc(strlen(name) + 1);
+    strcpy(sheet->name, name);
+    sheet->width = width;
+    sheet->height = height;
+    sheet->sum = *sum;
+    return numqualitysheets - 1;
+}
+
+static void note_frame_sum(int sheet, int xl, int yl, int w, int h, qualitysum_t sum)
+{
+    if (numqualityframes == maxqualityframes)
+    {
+        maxqualityframes = maxqualityframes ? maxqualityframes * 2 : 64;
+        qualityframes = safe_realloc(qualityframes, maxqualityframes * sizeof(qualityframe_t));
+    }
+
+    const char *name = spriteoutname ? spriteoutname : "";
+    qualityframe_t *frame = &qualityframes[numqualityframes++];
+    frame->sprite = safe_malloc(strlen(name) + 1);
+    strcpy(frame->sprite, name);
+    frame->frame = quality_sprite_frames++;
+    frame->sheet = sheet;
+    frame->x = xl;
+    frame->y = yl;
+    frame->w = w;
+    frame->h = h;
+    frame->sum = sum;
+}
+
+static void note_frame_quality(int xl, int yl, int w, int h)
+{
+    if (!quality_report_name || loaded_quality_sheet < 0)
+        return;
+
+    qualitysum_t sum = {0, 0, 0};
+
+    if (qualitytruecolor)
+    {
+        for (int y = yl; y < yl + h; y++)
+        {
+            size_t first = (size_t)y * byteimagewidth + xl;
+            accumulate_error(&sum, qualitypixels + first * 4, byteimage + first, w, qualitypalette, qualitykeyed);
+        }
+    }
+    else
+    {
+        const byte *indices = qualitypixels ? qualitypixels : byteimage;
+        uint64_t counts[PALETTE_SIZE];
+
+        memset(counts, 0, sizeof(counts));
+        for (int y = yl; y < yl + h; y++)
+        {
+            const byte *row = indices + (size_t)y * byteimagewidth + xl;
+            for (int x = 0; x < w; x++)
+                counts[row[x]]++;
+        }
+        add_index_errors(&sum, counts, qualityerrors);
+    }
+
+    note_frame_sum(loaded_quality_sheet, xl, yl, w, h, sum);
+}
+
+static void json_string(FILE *f, const char *text)
+{
+    fputc('"', f);
+    for (; *text; text++)
+    {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void json_quality(FILE *f, const qualitysum_t *sum)
+{
+    double mse = sum->pixels ? (double)sum->sumsq / (sum->pixels * 3.0) : 0.0;
+
+    fprintf(f, "\"pixels\": %llu, \"mse\": %.6f, \"max_error\": %d, \"psnr\": ",
+            (unsigned long long)sum->pixels, mse, sum->maxerror);
+    /* lossless has no finite PSNR */
+    if (sum->sumsq)
+        fprintf(f, "%.4f", 10.0 * log10(255.0 * 255.0 / mse));
+    else
+        fprintf(f, "null");
+}
+
+static void write_quality_report(void)
+{
+    FILE *f = !strcmp(quality_report_name, "-") ? stdout : safe_open_write(quality_report_name);
+
+    fprintf(f, "{\n  \"sheets\": [");
+    for (int i = 0; i < numqualitysheets; i++)
+    {
+        const qualitysheet_t *sheet = &qualitysheets[i];
+        fprintf(f, "%s\n    {\"index\": %d, \"file\": ", i ? "," : "", i);
+        json_string(f, sheet->name);
+        fprintf(f, ", \"width\": %d, \"height\": %d, ", sheet->width, sheet->height);
+        json_quality(f, &sheet->sum);
+        fprintf(f, "}");
+    }
+    fprintf(f, "%s],\n  \"frames\": [", numqualitysheets ? "\n  " : "");
+    for (int i = 0; i < numqualityframes; i++)
+    {
+        const qualityframe_t *frame = &qualityframes[i];
+        fprintf(f, "%s\n    {\"sprite\": ", i ? "," : "");
+        json_string(f, frame->sprite);
+        fprintf(f, ", \"frame\": %d, \"sheet\": %d, \"x\": %d, \"y\": %d, \"width\": %d, \"height\": %d, ",
+                frame->frame, frame->sheet, frame->x, frame->y, frame->w, frame->h);
+        json_quality(f, &frame->sum);
+        fprintf(f, "}");
+    }
+    fprintf(f, "%s]\n}\n", numqualityframes ? "\n  " : "");
+
+    if (f == stdout)
+        fflush(f);
+    else
+        fclose(f);
+}
+
+/* --plan: only the headers are read, to learn the image size. */
+static void plan_bmp(const char *filename, const char *path, int *width, int *height)
+{
+    byte buffer[PLAN_HEADER_BYTES];
+    const byte *data;
+    size_t size;
+    bmpheader_t header;
+
+    data = vfs_lookup(filename, &size);
+    if (!data)
+    {
+        FILE *f = safe_open_read(path);
+        size = fread(buffer, 1, sizeof(buffer), f);
+        fclose(f);
+        data = buffer;
+    }
+
+    const char *problem = read_bmp_header(data, size, &header);
+    if (problem)
+        error("%s: %s", path, problem);
+
+    *width = header.width;
+    *height = header.height;
+}
 
-                byteimage[y * width + x] = best_match;
-            }
-            else if (bpp == 32)
-            {
-                byte b = row_buffer[x * 4];
-                byte g = row_buffer[x * 4 + 1];
-                byte r = row_buffer[x * 4 + 2];
+static void load_bmp(const char *filename)
+{
+    char *path = resolve_path(filename);
 
-                int best_match = 0;
-                int best_distance = 999999;
+    if (plan_mode)
+    {
+        plan_bmp(filename, path, &byteimagewidth, &byteimageheight);
+        free(path);
+        return;
+    }
 
-                for (int i = 0; i < PALETTE_SIZE; i++)
-                {
-                    int dr = r - lbmpalette[i * 3];
-                    int dg = g - lbmpalette[i * 3 + 1];
-                    int db = b - lbmpalette[i * 3 + 2];
-                    int distance = dr * dr + dg * dg + db * db;
+    bmpimage_t image;
+    size_t archivebytes;
 
-                    if (distance < best_distance)
-                    {
-                        best_distance = distance;
-                        best_match = i;
-                    }
-                }
+    if (!prefetch_take(path, &image, &archivebytes))
+        archivebytes = read_bmp(filename, path, &image);
 
-                byteimage[y * width + x] = best_match;
-            }
+    if (archivebytes)
+    {
+        vfs_hits++;
+        vfs_bytes_read += archivebytes;
+    }
+    else
+    {
+        vfs_disk_reads++;
+    }
+
+    /* queue the next sheets before spending time on this one */
+    prefetch_fill();
+
+    if (quality_report_name)
+    {
+        qualitysum_t sum = {0, 0, 0};
+        install_bmp(&image, &sum);
+        loaded_quality_sheet = note_sheet_quality(filename, byteimagewidth, byteimageheight, &sum);
+    }
+    else
+    {
+        install_bmp(&image, NULL);
+    }
+
+    free(image.pixels);
+    free(path);
+}
+
+static void copy_rect(byte *dest, int xl, int yl, int w, int h)
+{
+    const byte *source = byteimage + (size_t)yl * byteimagewidth + xl;
+
+    for (int y = 0; y < h; y++)
+    {
+        memcpy(dest, source, w);
+        dest += w;
+        source += byteimagewidth;
+    }
+}
+
+/*
+ * Compact frame store (--compact-frames). Frame rows are packed as they are
+ * cut, PackBits style: a control byte below 128 is followed by that many
+ * plus one literal bytes, and 128 + n repeats the next byte n + 2 times.
+ * Rows never share a packet, so a frame unpacks straight into the output.
+ */
+static int scan_run(const byte *p, int remaining)
+{
+    uint64_t pattern = p[0] * 0x0101010101010101ull;
+    int length = 1;
+
+    if (remaining > PACK_MAX_RUN)
+        remaining = PACK_MAX_RUN;
+
+    /* whole words first, so long transparent spans cost one compare per 8 pixels */
+    while (length + 8 <= remaining)
+    {
+        uint64_t word;
+        memcpy(&word, p + length, 8);
+        if (word != pattern)
+            break;
+        length += 8;
+    }
+    while (length < remaining && p[length] == p[0])
+        length++;
+
+    return length;
+}
+
+static size_t pack_bound(int w, int h)
+{
+    return ((size_t)w + (w + PACK_MAX_LITERAL - 1) / PACK_MAX_LITERAL) * h;
+}
+
+static byte *pack_row(byte *out, const byte *row, int w)
+{
+    int x = 0;
+
+    while (x < w)
+    {
+        int run = scan_run(row + x, w - x);
+        if (run >= 3)
+        {
+            *out++ = (byte)(128 + run - 2);
+            *out++ = row[x];
+            x += run;
+            continue;
+        }
+
+        int start = x;
+        while (x < w && x - start < PACK_MAX_LITERAL)
+        {
+            if (x + 2 < w && row[x] == row[x + 1] && row[x] == row[x + 2])
+                break;
+            x++;
         }
+        *out++ = (byte)(x - start - 1);
+        memcpy(out, row + start, x - start);
+        out += x - start;
     }
 
-    free(row_buffer);
-    fclose(f);
+    return out;
+}
+
+static void unpack_frame(byte *dest, const byte *packed, size_t size)
+{
+    byte *end = dest + size;
+
+    while (dest < end)
+    {
+        int control = *packed++;
+        if (control < 128)
+        {
+            memcpy(dest, packed, control + 1);
+            packed += control + 1;
+            dest += control + 1;
+        }
+        else
+        {
+            memset(dest, *packed++, control - 126);
+            dest += control - 126;
+        }
+    }
+}
+
+/*
+ * Stores the pixels of a w x h rectangle of byteimage at plump and returns
+ * the number of bytes used: w * h, or the packed size in compact mode.
+ */
+static size_t store_rect(int xl, int yl, int w, int h)
+{
+    store_raw_bytes += sizeof(dspriteframe_t) + (size_t)w * h;
+
+    if (plan_mode)
+        return 0;
+
+    if (!compact_frames)
+    {
+        copy_rect(plump, xl, yl, w, h);
+        return (size_t)w * h;
+    }
 
-    if (fullpath)
-        free(fullpath);
+    const byte *source = byteimage + (size_t)yl * byteimagewidth + xl;
+    byte *out = plump;
+    for (int y = 0; y < h; y++, source += byteimagewidth)
+        out = pack_row(out, source, w);
+    return out - plump;
 }
 
 static void grab_frame(void)
 {
     dspriteframe_t *pframe;
-    int x, y, xl, yl, w, h;
-    byte *source;
+    int xl, yl, w, h;
 
     get_token(false);
     xl = atoi(token);
@@ -641,11 +2972,11 @@ static void grab_frame(void)
         error("Bad frame coordinates");
     }
 
-    ensure_frame_capacity();
+    ensure_frame_capacity(1);
 
     frames[framecount].type = SPR_SINGLE;
 
-    size_t frame_size = sizeof(dspriteframe_t) + w * h;
+    size_t frame_size = sizeof(dspriteframe_t) + (compact_frames ? pack_bound(w, h) : (size_t)w * h);
     ensure_buffer_capacity((plump - lumpbuffer) + frame_size);
 
     pframe = (dspriteframe_t *)plump;
@@ -683,24 +3014,547 @@ static void grab_frame(void)
     if (h > framesmaxs[1])
         framesmaxs[1] = h;
 
-    source = byteimage + yl * byteimagewidth + xl;
+    plump += store_rect(xl, yl, w, h);
+    note_frame_quality(xl, yl, w, h);
+
+    frames[framecount].pdata = pframe;
+    framecount++;
+}
+
+static void copy_grid_cells(void *arg, int begin, int end)
+{
+    const gridcopy_t *grid = arg;
+
+    for (int i = begin; i < end; i++)
+    {
+        byte *dest = grid->base + (size_t)i * grid->stride + sizeof(dspriteframe_t);
+        int x = grid->x0 + (i % grid->cols) * grid->w;
+        int y = grid->y0 + (i / grid->cols) * grid->h;
+
+        copy_rect(dest, x, y, grid->w, grid->h);
+    }
+}
+
+/*
+ * $grid x0 y0 cellw cellh cols rows [interval] [count]
+ * Cuts count cells (default cols * rows) in row-major order. Storage for
+ * all of them is reserved up front and large grids are copied in parallel.
+ * Returns the number of frames added.
+ */
+static int grab_grid(void)
+{
+    int args[6];
+    float interval = 0.1f;
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (!get_token(false))
+            error("$grid expects x0 y0 cellw cellh cols rows [interval] [count]");
+        args[i] = atoi(token);
+    }
+
+    int x0 = args[0], y0 = args[1], w = args[2], h = args[3], cols = args[4], rows = args[5];
+
+    /* checked in 64 bits, so large arguments cannot overflow before the sheet bounds them */
+    int64_t cells = (int64_t)cols * rows;
+    int64_t wanted = cells;
+
+    if (get_token(false))
+    {
+        interval = atof(token);
+        if (interval <= 0.0)
+            error("Non-positive interval");
+
+        if (get_token(false))
+            wanted = atoi(token);
+    }
+
+    if (x0 < 0 || y0 < 0 || w <= 0 || h <= 0 || cols <= 0 || rows <= 0)
+        error("Bad grid coordinates");
+    if (wanted <= 0 || wanted > cells)
+        error("Bad grid cell count: %lld", (long long)wanted);
+
+    int64_t usedcols = wanted < cols ? wanted : cols;
+    int64_t usedrows = (wanted + cols - 1) / cols;
+    if (x0 + usedcols * w > byteimagewidth || y0 + usedrows * h > byteimageheight)
+        error("Bad grid coordinates");
+
+    /* a huge sheet of tiny cells can still hold too many frames */
+    if (wanted > INT_MAX - framecount)
+        error("Bad grid cell count: %lld", (long long)wanted);
+    int count = (int)wanted;
+
+    if (w > framesmaxs[0])
+        framesmaxs[0] = w;
+    if (h > framesmaxs[1])
+        framesmaxs[1] = h;
+
+    ensure_frame_capacity(count);
+
+    if (compact_frames || plan_mode)
+    {
+        /* packed cells vary in size, so they are stored one after another */
+        for (int i = 0; i < count; i++)
+        {
+            ensure_buffer_capacity((plump - lumpbuffer) + sizeof(dspriteframe_t) + pack_bound(w, h));
+
+            dspriteframe_t *pframe = (dspriteframe_t *)plump;
+            pframe->origin[0] = -(w >> 1);
+            pframe->origin[1] = h >> 1;
+            pframe->width = w;
+            pframe->height = h;
+
+            frames[framecount].type = SPR_SINGLE;
+            frames[framecount].interval = interval;
+            frames[framecount].pdata = pframe;
+            framecount++;
+
+            plump += sizeof(dspriteframe_t);
+            plump += store_rect(x0 + (i % cols) * w, y0 + (i / cols) * h, w, h);
+            note_frame_quality(x0 + (i % cols) * w, y0 + (i / cols) * h, w, h);
+        }
+        return count;
+    }
+
+    size_t stride = sizeof(dspriteframe_t) + (size_t)w * h;
+
+    ensure_buffer_capacity((plump - lumpbuffer) + stride * count);
+    store_raw_bytes += stride * count;
+
+    gridcopy_t grid;
+    grid.base = plump;
+    grid.stride = stride;
+    grid.x0 = x0;
+    grid.y0 = y0;
+    grid.w = w;
+    grid.h = h;
+    grid.cols = cols;
+
+    for (int i = 0; i < count; i++)
+    {
+        dspriteframe_t *pframe = (dspriteframe_t *)plump;
+
+        pframe->origin[0] = -(w >> 1);
+        pframe->origin[1] = h >> 1;
+        pframe->width = w;
+        pframe->height = h;
+
+        frames[framecount].type = SPR_SINGLE;
+        frames[framecount].interval = interval;
+        frames[framecount].pdata = pframe;
+        framecount++;
+        note_frame_quality(x0 + (i % cols) * w, y0 + (i / cols) * h, w, h);
+
+        plump += stride;
+    }
+
+    if ((size_t)count * w * h >= GRID_PARALLEL_PIXELS)
+        parallel_for(count, copy_grid_cells, &grid);
+    else
+        copy_grid_cells(&grid, 0, count);
+
+    return count;
+}
+
+static void decode_framefiles(void *arg, int begin, int end)
+{
+    framefile_t *files = arg;
+
+    for (int i = begin; i < end; i++)
+        files[i].ok = try_read_bmp(files[i].name, files[i].path, &files[i].image, &files[i].archivebytes);
+}
+
+static void convert_framefiles(void *arg, int begin, int end)
+{
+    framefile_t *files = arg;
+
+    for (int i = begin; i < end; i++)
+        convert_image(&files[i].image, files[i].remapped ? files[i].remap : NULL, files[i].dest,
+                      quality_report_name ? &files[i].quality : NULL, true);
+}
+
+/*
+ * Decodes a batch of $framefile images in parallel and quantizes each one
+ * straight into its frame slot. Palettes are picked in script order first,
+ * so the result is the same as loading the files one by one.
+ */
+static void store_framefiles(framefile_t *files, int count)
+{
+    if (plan_mode)
+    {
+        for (int i = 0; i < count; i++)
+            plan_bmp(files[i].name, files[i].path, &files[i].width, &files[i].height);
+    }
+    else
+    {
+        parallel_for(count, decode_framefiles, files);
+
+        for (int i = 0; i < count; i++)
+        {
+            framefile_t *f = &files[i];
+
+            /* report failures from this thread, as $load would */
+            if (!f->ok)
+            {
+                free(f->image.pixels);
+                f->archivebytes = read_bmp(f->name, f->path, &f->image);
+            }
+
+            if (f->archivebytes)
+            {
+                vfs_hits++;
+                vfs_bytes_read += f->archivebytes;
+            }
+            else
+            {
+                vfs_disk_reads++;
+            }
+
+            f->width = f->image.width;
+            f->height = f->image.height;
+            f->remapped = f->image.bpp == 8 && build_remap(&f->image, f->remap);
+            select_palette(&f->image);
+
+            memset(&f->quality, 0, sizeof(f->quality));
+            if (compact_frames)
+                f->dest = safe_malloc((size_t)f->width * f->height);
+        }
+
+        /* every truecolor file in the batch is mapped against the same palette */
+        prepare_color_lookup();
+    }
+
+    ensure_frame_capacity(count);
+
+    size_t needed = plump - lumpbuffer;
+    for (int i = 0; i < count; i++)
+    {
+        int w = files[i].width, h = files[i].height;
+
+        needed += sizeof(dspriteframe_t);
+        if (!plan_mode)
+            needed += compact_frames ? pack_bound(w, h) : (size_t)w * h;
+    }
+    ensure_buffer_capacity(needed);
+
+    /* raw slots are final once reserved, so decoding writes straight into them */
+    if (!plan_mode && !compact_frames)
+    {
+        byte *slot = plump;
+        for (int i = 0; i < count; i++)
+        {
+            files[i].dest = slot + sizeof(dspriteframe_t);
+            slot = files[i].dest + (size_t)files[i].width * files[i].height;
+        }
+    }
+
+    if (!plan_mode)
+        parallel_for(count, convert_framefiles, files);
+
+    for (int i = 0; i < count; i++)
+    {
+        framefile_t *f = &files[i];
+        int w = f->width, h = f->height;
+        dspriteframe_t *pframe = (dspriteframe_t *)plump;
+
+        pframe->origin[0] = f->hasorigin ? f->origin[0] : -(w >> 1);
+        pframe->origin[1] = f->hasorigin ? f->origin[1] : h >> 1;
+        pframe->width = w;
+        pframe->height = h;
+        plump += sizeof(dspriteframe_t);
+
+        if (w > framesmaxs[0])
+            framesmaxs[0] = w;
+        if (h > framesmaxs[1])
+            framesmaxs[1] = h;
+
+        store_raw_bytes += sizeof(dspriteframe_t) + (size_t)w * h;
+        if (compact_frames && !plan_mode)
+        {
+            byte *out = plump;
+            for (int y = 0; y < h; y++)
+                out = pack_row(out, f->dest + (size_t)y * w, w);
+            plump = out;
+            free(f->dest);
+        }
+        else if (!plan_mode)
+        {
+            plump += (size_t)w * h;
+        }
+
+        if (quality_report_name && !plan_mode)
+        {
+            int sheet = note_sheet_quality(f->name, w, h, &f->quality);
+            note_frame_sum(sheet, 0, 0, w, h, f->quality);
+        }
+
+        frames[framecount].type = SPR_SINGLE;
+        frames[framecount].interval = f->interval;
+        frames[framecount].pdata = pframe;
+        framecount++;
+
+        free(f->image.pixels);
+        free(f->name);
+        free(f->path);
+    }
+}
+
+/*
+ * $framefile path [interval] [originx originy]
+ * Each file becomes one whole frame. A run of consecutive $framefile lines
+ * is taken together, so its files are decoded in parallel; frames keep
+ * script order. Returns the number of frames added.
+ */
+static int grab_framefiles(void)
+{
+    framefile_t files[FRAMEFILE_BATCH];
+    int count = 0;
+    int total = 0;
+
+    for (;;)
+    {
+        framefile_t *f = &files[count];
+
+        memset(f, 0, sizeof(*f));
+        if (!get_token(false))
+            error("$framefile expects path [interval] [originx originy]");
+        f->name = safe_malloc(strlen(token) + 1);
+        strcpy(f->name, token);
+        f->path = resolve_path(token);
+
+        f->interval = 0.1f;
+        if (get_token(false))
+        {
+            f->interval = atof(token);
+            if (f->interval <= 0.0)
+                error("Non-positive interval");
+
+            if (get_token(false))
+            {
+                f->hasorigin = true;
+                f->origin[0] = -atoi(token);
+                if (!get_token(false))
+                    error("$framefile expects path [interval] [originx originy]");
+                f->origin[1] = atoi(token);
+            }
+        }
+
+        if (++count == FRAMEFILE_BATCH)
+        {
+            store_framefiles(files, count);
+            total += count;
+            count = 0;
+        }
+
+        /* look one directive ahead; anything but another $framefile is left for the caller */
+        char *next = scriptptr;
+        if (!get_token(true) || strcmp(token, "$framefile"))
+        {
+            scriptptr = next;
+            break;
+        }
+    }
+
+    if (count)
+        store_framefiles(files, count);
+    return total + count;
+}
+
+/* The sprite is serialized into memory and written out with a single call. */
+static void out_write(const void *data, size_t count)
+{
+    if (outlength + count > outbuffer_size)
+    {
+        outbuffer_size = (outlength + count) * 2;
+        outbuffer = safe_realloc(outbuffer, outbuffer_size);
+    }
+    memcpy(outbuffer + outlength, data, count);
+    outlength += count;
+}
+
+static void out_frame_pixels(const dspriteframe_t *pframe)
+{
+    size_t size = (size_t)pframe->width * pframe->height;
+
+    if (!compact_frames)
+    {
+        out_write((const byte *)(pframe + 1), size);
+        return;
+    }
+
+    if (outlength + size > outbuffer_size)
+    {
+        outbuffer_size = (outlength + size) * 2;
+        outbuffer = safe_realloc(outbuffer, outbuffer_size);
+    }
+    unpack_frame(outbuffer + outlength, (const byte *)(pframe + 1), size);
+    outlength += size;
+}
+
+static void write_sprite_file(const char *name)
+{
+    if (!strcmp(name, "-"))
+    {
+        safe_write(stdout, outbuffer, outlength);
+        fflush(stdout);
+    }
+    else
+    {
+        FILE *spriteouthandle = safe_open_write(name);
+        safe_write(spriteouthandle, outbuffer, outlength);
+        fclose(spriteouthandle);
+    }
+}
+
+static void free_variants(void)
+{
+    for (int i = 0; i < numvariants; i++)
+        free(variants[i].outname);
+    numvariants = 0;
+}
+
+static bool lookup_type(const char *name, int *type)
+{
+    if (!strcmp(name, "vp_parallel_upright"))
+        *type = SPR_VP_PARALLEL_UPRIGHT;
+    else if (!strcmp(name, "facing_upright"))
+        *type = SPR_FACING_UPRIGHT;
+    else if (!strcmp(name, "vp_parallel"))
+        *type = SPR_VP_PARALLEL;
+    else if (!strcmp(name, "oriented"))
+        *type = SPR_ORIENTED;
+    else if (!strcmp(name, "vp_parallel_oriented"))
+        *type = SPR_VP_PARALLEL_ORIENTED;
+    else
+        return false;
+    return true;
+}
+
+static bool lookup_texformat(const char *name, int *texformat)
+{
+    if (!strcmp(name, "normal"))
+        *texformat = SPR_NORMAL;
+    else if (!strcmp(name, "additive"))
+        *texformat = SPR_ADDITIVE;
+    else if (!strcmp(name, "indexalpha"))
+        *texformat = SPR_INDEXALPHA;
+    else if (!strcmp(name, "alphatest"))
+        *texformat = SPR_ALPHTEST;
+    else
+        return false;
+    return true;
+}
+
+/*
+ * $variant name [type] [texture]: one more output of the current sprite,
+ * written from the same frames with its own header type and texFormat.
+ * Whatever is not given follows the sprite's own settings at finish time.
+ * Pixels are quantized once, for the sprite's own texture format.
+ */
+static void add_variant(void)
+{
+    if (!spriteoutname)
+        error("$variant before $spritename");
+    if (!get_token(false))
+        error("$variant expects name [type] [texture]");
+
+    char *outname = safe_malloc(strlen(spritedir) + strlen(token) + 16);
+    sprintf(outname, "%s%s.spr", spritedir, token);
+
+    /* outputs that share a path would overwrite each other */
+    if (!strcmp(outname, spriteoutname))
+        error("Variant %s is the sprite's own output", outname);
+    for (int i = 0; i < numvariants; i++)
+    {
+        if (!strcmp(outname, variants[i].outname))
+            error("Variant %s is declared twice", outname);
+    }
+
+    if (numvariants == maxvariants)
+    {
+        maxvariants = maxvariants ? maxvariants * 2 : 4;
+        variants = safe_realloc(variants, maxvariants * sizeof(spritevariant_t));
+    }
+
+    spritevariant_t *variant = &variants[numvariants++];
+    variant->outname = outname;
+    variant->type = -1;
+    variant->texformat = -1;
+
+    while (get_token(false))
+    {
+        if (!lookup_type(token, &variant->type) && !lookup_texformat(token, &variant->texformat))
+            error("Bad variant setting: %s", token);
+    }
+}
+
+static void plan_frame(const dspriteframe_t *pframe, size_t *size)
+{
+    printf("\"width\": %d, \"height\": %d, \"origin\": [%d, %d]",
+           pframe->width, pframe->height, pframe->origin[0], pframe->origin[1]);
+    *size += sizeof(dspriteframe_t) + (size_t)pframe->width * pframe->height;
+}
+
+/*
+ * --plan: describes the sprite finish_sprite would write, as one JSON
+ * object, with the file size worked out from the frame headers alone.
+ */
+static void plan_sprite(void)
+{
+    size_t size = sizeof(dsprite_t) + (do16bit ? sizeof(short) + PALETTE_SIZE * 3 : 0);
+    int curframe = 0;
+    int pictures = 0;
+
+    printf("%s\n    {\"output\": ", plan_sprites++ ? "," : "");
+    json_string(stdout, spriteoutname);
+    printf(", \"type\": %d, \"texformat\": %d, \"width\": %d, \"height\": %d, \"boundingradius\": %.9g,\n",
+           sprite.type, sprite.texFormat, framesmaxs[0], framesmaxs[1], sprite.boundingradius);
+    printf("     \"entries\": [");
 
-    for (y = 0; y < h; y++)
+    for (int i = 0; i < sprite.numframes; i++)
     {
-        for (x = 0; x < w; x++)
+        printf("%s\n       ", i ? "," : "");
+        size += sizeof(dspriteframetype_t);
+
+        if (frames[curframe].type == SPR_SINGLE)
         {
-            *plump++ = source[x];
+            printf("{\"type\": \"single\", ");
+            plan_frame(frames[curframe].pdata, &size);
+            printf("}");
+            curframe++;
+            pictures++;
+            continue;
         }
-        source += byteimagewidth;
+
+        int numframes = frames[curframe].numgroupframes;
+        float totinterval = 0.0;
+
+        size += sizeof(dspritegroup_t) + numframes * sizeof(dspriteinterval_t);
+        printf("{\"type\": \"group\", \"frames\": [");
+        curframe++;
+        for (int j = 0; j < numframes; j++, curframe++)
+        {
+            totinterval += frames[curframe].interval;
+            printf("%s\n         {", j ? "," : "");
+            plan_frame(frames[curframe].pdata, &size);
+            printf(", \"interval\": %.9g}", totinterval);
+            pictures++;
+        }
+        printf("]}");
     }
 
-    frames[framecount].pdata = pframe;
-    framecount++;
+    printf("],\n     \"frames\": %d, \"size\": %zu, \"variants\": [", pictures, size);
+    for (int i = 0; i < numvariants; i++)
+    {
+        printf("%s{\"output\": ", i ? ", " : "");
+        json_string(stdout, variants[i].outname);
+        printf(", \"type\": %d, \"texformat\": %d}", variants[i].type, variants[i].texformat);
+    }
+    printf("]}");
 }
 
 static void finish_sprite(void)
 {
-    FILE *spriteouthandle;
     int i, curframe;
     dsprite_t spritetemp;
     dspriteframetype_t frametype;
@@ -710,7 +3564,6 @@ static void finish_sprite(void)
         error("No frames\n");
     }
 
-    sprite.numframes = framecount;
     sprite.boundingradius = sqrt(((framesmaxs[0] >> 1) * (framesmaxs[0] >> 1)) +
                                  ((framesmaxs[1] >> 1) * (framesmaxs[1] >> 1)));
     sprite.width = framesmaxs[0];
@@ -719,7 +3572,21 @@ static void finish_sprite(void)
     if (!spriteoutname)
         error("No output file specified. Use $spritename in the script or provide -o/--output");
 
-    spriteouthandle = safe_open_write(spriteoutname);
+    for (i = 0; i < numvariants; i++)
+    {
+        if (variants[i].type < 0)
+            variants[i].type = sprite.type;
+        if (variants[i].texformat < 0)
+            variants[i].texformat = sprite.texFormat;
+    }
+
+    if (plan_mode)
+    {
+        plan_sprite();
+        return;
+    }
+
+    outlength = 0;
 
     spritetemp.ident = little_long(IDSPRITEHEADER);
     spritetemp.version = little_long(SPRITE_VERSION);
@@ -732,20 +3599,20 @@ static void finish_sprite(void)
     spritetemp.beamlength = little_float(sprite.beamlength);
     spritetemp.synctype = little_long(sprite.synctype);
 
-    safe_write(spriteouthandle, &spritetemp, sizeof(spritetemp));
+    out_write(&spritetemp, sizeof(spritetemp));
 
     if (do16bit)
     {
         short cnt = PALETTE_SIZE;
-        safe_write(spriteouthandle, &cnt, sizeof(cnt));
-        safe_write(spriteouthandle, lbmpalette, cnt * 3);
+        out_write(&cnt, sizeof(cnt));
+        out_write(lbmpalette, cnt * 3);
     }
 
     curframe = 0;
     for (i = 0; i < sprite.numframes; i++)
     {
         frametype.type = little_long(frames[curframe].type);
-        safe_write(spriteouthandle, &frametype, sizeof(frametype));
+        out_write(&frametype, sizeof(frametype));
 
         if (frames[curframe].type == SPR_SINGLE)
         {
@@ -757,8 +3624,8 @@ static void finish_sprite(void)
             frametemp.width = little_long(pframe->width);
             frametemp.height = little_long(pframe->height);
 
-            safe_write(spriteouthandle, &frametemp, sizeof(frametemp));
-            safe_write(spriteouthandle, (byte *)(pframe + 1), pframe->width * pframe->height);
+            out_write(&frametemp, sizeof(frametemp));
+            out_frame_pixels(pframe);
             curframe++;
         }
         else
@@ -773,7 +3640,7 @@ static void finish_sprite(void)
             numframes = frames[groupframe].numgroupframes;
 
             dsgroup.numframes = little_long(numframes);
-            safe_write(spriteouthandle, &dsgroup, sizeof(dsgroup));
+            out_write(&dsgroup, sizeof(dsgroup));
 
             totinterval = 0.0;
             for (j = 0; j < numframes; j++)
@@ -781,7 +3648,7 @@ static void finish_sprite(void)
                 dspriteinterval_t temp;
                 totinterval += frames[groupframe + 1 + j].interval;
                 temp.interval = little_float(totinterval);
-                safe_write(spriteouthandle, &temp, sizeof(temp));
+                out_write(&temp, sizeof(temp));
             }
 
             for (j = 0; j < numframes; j++)
@@ -794,18 +3661,462 @@ static void finish_sprite(void)
                 frametemp.width = little_long(pframe->width);
                 frametemp.height = little_long(pframe->height);
 
-                safe_write(spriteouthandle, &frametemp, sizeof(frametemp));
-                safe_write(spriteouthandle, (byte *)(pframe + 1), pframe->width * pframe->height);
+                out_write(&frametemp, sizeof(frametemp));
+                out_frame_pixels(pframe);
                 curframe++;
             }
         }
     }
 
-    fclose(spriteouthandle);
+    write_sprite_file(spriteoutname);
+
+    /* variants share everything after the header, so only type and texFormat are patched */
+    for (i = 0; i < numvariants; i++)
+    {
+        spritetemp.type = little_long(variants[i].type);
+        spritetemp.texFormat = little_long(variants[i].texformat);
+        memcpy(outbuffer, &spritetemp, sizeof(spritetemp));
+        write_sprite_file(variants[i].outname);
+    }
+
+    fprintf(msgout, "sprgen: successful\n");
+    fprintf(msgout, "%d frame(s)\n", framecount);
+    fprintf(msgout, "%d ungrouped frame(s), including group headers\n", sprite.numframes);
+    for (i = 0; i < numvariants; i++)
+        fprintf(msgout, "variant %s\n", variants[i].outname);
+
+    size_t stored = plump - lumpbuffer;
+    if (compact_frames)
+        fprintf(msgout, "frame store: %zu bytes packed from %zu (%.2f:1)\n",
+                stored, store_raw_bytes, stored ? (double)store_raw_bytes / stored : 0.0);
+    if (store_raw_bytes > store_peak_raw)
+        store_peak_raw = store_raw_bytes;
+    if (stored > store_peak_packed)
+        store_peak_packed = stored;
+}
+
+/*
+ * --build-palette: one palette for a whole batch. Every $load and $framefile
+ * image of the given scripts (and any BMP given directly) is counted into a
+ * per-thread sparse histogram, the histograms are merged, and median cut
+ * reduces the result to PALETTE_SIZE colors.
+ */
+static void histogram_init(histogram_t *hist, size_t size)
+{
+    hist->size = size;
+    hist->used = 0;
+    hist->shift = 0;
+    hist->bins = safe_malloc(size * sizeof(colorbin_t));
+    memset(hist->bins, 0, size * sizeof(colorbin_t));
+}
+
+static void histogram_insert(histogram_t *hist, uint32_t key, const colorbin_t *add)
+{
+    size_t mask = hist->size - 1;
+    uint32_t mix = key;
+    mix ^= mix >> 16;
+    mix *= 0x45d9f3bu;
+    mix ^= mix >> 16;
+    size_t slot = mix & mask;
+
+    while (hist->bins[slot].key && hist->bins[slot].key != key)
+        slot = (slot + 1) & mask;
+
+    colorbin_t *bin = &hist->bins[slot];
+    if (!bin->key)
+    {
+        bin->key = key;
+        hist->used++;
+    }
+    bin->count += add->count;
+    bin->sum[0] += add->sum[0];
+    bin->sum[1] += add->sum[1];
+    bin->sum[2] += add->sum[2];
+}
+
+static uint32_t histogram_key(const histogram_t *hist, int r, int g, int b)
+{
+    int shift = hist->shift;
+    return (((uint32_t)(r >> shift) << 16) | ((uint32_t)(g >> shift) << 8) | (uint32_t)(b >> shift)) + 1;
+}
+
+/* The key of the same color with `drop` more low bits dropped per channel. */
+static uint32_t coarsen_key(uint32_t key, int drop)
+{
+    uint32_t color = key - 1;
+    int r = (color >> 16) & 255, g = (color >> 8) & 255, b = color & 255;
+
+    return (((uint32_t)(r >> drop) << 16) | ((uint32_t)(g >> drop) << 8) | (uint32_t)(b >> drop)) + 1;
+}
+
+/*
+ * Rebuilds the table with `shift` low bits dropped per channel. Bins keep
+ * their color sums, so merged bins still average to the right color.
+ */
+static void histogram_rehash(histogram_t *hist, int shift, size_t size)
+{
+    histogram_t old = *hist;
+
+    histogram_init(hist, size);
+    hist->shift = shift;
+
+    for (size_t i = 0; i < old.size; i++)
+    {
+        const colorbin_t *bin = &old.bins[i];
+        if (!bin->key)
+            continue;
+
+        histogram_insert(hist, coarsen_key(bin->key, shift - old.shift), bin);
+    }
+
+    free(old.bins);
+}
+
+/*
+ * Keeps the table at most half full. Past HISTOGRAM_MAX_BINS colors it is
+ * coarsened instead of grown, so memory stays bounded however many
+ * distinct colors arrive.
+ */
+static void histogram_grow(histogram_t *hist)
+{
+    if (hist->used * 2 > hist->size)
+    {
+        if (hist->used > HISTOGRAM_MAX_BINS)
+            histogram_rehash(hist, hist->shift + 1, hist->size);
+        else
+            histogram_rehash(hist, hist->shift, hist->size * 2);
+    }
+}
+
+static void histogram_add(histogram_t *hist, int r, int g, int b, uint64_t count)
+{
+    colorbin_t add;
+
+    add.count = count;
+    add.sum[0] = (uint64_t)r * count;
+    add.sum[1] = (uint64_t)g * count;
+    add.sum[2] = (uint64_t)b * count;
+    histogram_insert(hist, histogram_key(hist, r, g, b), &add);
+    histogram_grow(hist);
+}
+
+static void histogram_images(void *arg, int begin, int end)
+{
+    palettebuild_t *build = arg;
+
+    pthread_mutex_lock(&build->lock);
+    histogram_t *hist = &build->histograms[build->numhistograms++];
+    pthread_mutex_unlock(&build->lock);
+
+    histogram_init(hist, 4096);
+
+    for (int i = begin; i < end; i++)
+    {
+        bmpimage_t image;
+        read_bmp(build->names[i], build->paths[i], &image);
+
+        size_t numpixels = (size_t)image.width * image.height;
+        const byte *p = image.pixels;
+        int runr = -1, rung = 0, runb = 0;
+        uint64_t run = 0;
+
+        /* runs of one color are common in sprite art; hash them once */
+        for (size_t j = 0; j < numpixels; j++)
+        {
+            int r, g, b;
+            if (image.bpp == 8)
+            {
+                const byte *c = image.palette + p[j] * 3;
+                r = c[0];
+                g = c[1];
+                b = c[2];
+            }
+            else
+            {
+                r = p[j * 4 + 2];
+                g = p[j * 4 + 1];
+                b = p[j * 4];
+            }
+
+            if (r == runr && g == rung && b == runb)
+            {
+                run++;
+                continue;
+            }
+            if (run)
+                histogram_add(hist, runr, rung, runb, run);
+            runr = r;
+            rung = g;
+            runb = b;
+            run = 1;
+        }
+        if (run)
+            histogram_add(hist, runr, rung, runb, run);
+
+        pthread_mutex_lock(&build->lock);
+        build->pixels += numpixels;
+        pthread_mutex_unlock(&build->lock);
+
+        free(image.pixels);
+    }
+}
+
+static int compare_points_axis;
+
+static int compare_points(const void *a, const void *b)
+{
+    const colorpoint_t *pa = a, *pb = b;
+
+    for (int i = 0; i < 3; i++)
+    {
+        int c = (compare_points_axis + i) % 3;
+        if (pa->rgb[c] != pb->rgb[c])
+            return pa->rgb[c] - pb->rgb[c];
+    }
+    return 0;
+}
+
+static void measure_box(const colorpoint_t *points, colorbox_t *box)
+{
+    int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+
+    box->weight = 0;
+    for (int i = box->first; i < box->first + box->count; i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            if (points[i].rgb[c] < lo[c])
+                lo[c] = points[i].rgb[c];
+            if (points[i].rgb[c] > hi[c])
+                hi[c] = points[i].rgb[c];
+        }
+        box->weight += points[i].count;
+    }
+
+    box->axis = 0;
+    for (int c = 1; c < 3; c++)
+    {
+        if (hi[c] - lo[c] > hi[box->axis] - lo[box->axis])
+            box->axis = c;
+    }
+    box->range = hi[box->axis] - lo[box->axis];
+}
+
+/* Median cut over the merged bins, weighted by pixel count. */
+static void median_cut(colorpoint_t *points, int numpoints, byte *palette)
+{
+    colorbox_t boxes[PALETTE_SIZE];
+    int numboxes = 1;
+
+    memset(palette, 0, PALETTE_SIZE * 3);
+    if (!numpoints)
+        return;
+
+    boxes[0].first = 0;
+    boxes[0].count = numpoints;
+    measure_box(points, &boxes[0]);
+
+    while (numboxes < PALETTE_SIZE)
+    {
+        int best = -1;
+        double bestscore = 0;
+
+        for (int i = 0; i < numboxes; i++)
+        {
+            double score = (double)boxes[i].weight * boxes[i].range * boxes[i].range;
+            if (boxes[i].count > 1 && (best < 0 || score > bestscore))
+            {
+                best = i;
+                bestscore = score;
+            }
+        }
+        if (best < 0)
+            break;
+
+        colorbox_t *box = &boxes[best];
+        compare_points_axis = box->axis;
+        qsort(points + box->first, box->count, sizeof(colorpoint_t), compare_points);
+
+        uint64_t half = box->weight / 2, accumulated = 0;
+        int split = box->first + 1;
+        for (int i = box->first; i < box->first + box->count - 1; i++)
+        {
+            accumulated += points[i].count;
+            split = i + 1;
+            if (accumulated >= half)
+                break;
+        }
+
+        colorbox_t *other = &boxes[numboxes++];
+        other->first = split;
+        other->count = box->first + box->count - split;
+        box->count = split - box->first;
+        measure_box(points, box);
+        measure_box(points, other);
+    }
+
+    for (int i = 0; i < numboxes; i++)
+    {
+        uint64_t count = 0, sum[3] = {0, 0, 0};
+        for (int j = boxes[i].first; j < boxes[i].first + boxes[i].count; j++)
+        {
+            count += points[j].count;
+            for (int c = 0; c < 3; c++)
+                sum[c] += points[j].sum[c];
+        }
+        for (int c = 0; c < 3; c++)
+            palette[i * 3 + c] = (byte)((sum[c] + count / 2) / count);
+    }
+}
+
+static bool has_extension(const char *name, const char *extension)
+{
+    size_t length = strlen(name), extlength = strlen(extension);
+    if (length < extlength)
+        return false;
+    for (size_t i = 0; i < extlength; i++)
+    {
+        if (tolower((unsigned char)name[length - extlength + i]) != extension[i])
+            return false;
+    }
+    return true;
+}
+
+static void add_palette_source(palettebuild_t *build, const char *name)
+{
+    if (build->numimages == build->maximages)
+    {
+        build->maximages = build->maximages ? build->maximages * 2 : 64;
+        build->names = safe_realloc(build->names, build->maximages * sizeof(char *));
+        build->paths = safe_realloc(build->paths, build->maximages * sizeof(char *));
+    }
+    build->names[build->numimages] = safe_malloc(strlen(name) + 1);
+    strcpy(build->names[build->numimages], name);
+    build->paths[build->numimages] = resolve_path(name);
+    build->numimages++;
+}
+
+static void build_palette(const char *outname, char **inputs, int numinputs, const char *basedir)
+{
+    palettebuild_t build;
+    double start, t_scan, t_histogram, t_merge, t_quantize, t_write;
+
+    memset(&build, 0, sizeof(build));
+    pthread_mutex_init(&build.lock, NULL);
+    start = now_seconds();
+
+    for (int i = 0; i < numinputs; i++)
+    {
+        free(spritedir);
+        if (has_extension(inputs[i], ".bmp"))
+        {
+            spritedir = script_dir("", basedir);
+            add_palette_source(&build, inputs[i]);
+            continue;
+        }
+
+        spritedir = script_dir(inputs[i], basedir);
+        start_script_parse(inputs[i]);
+
+        char *cursor = scriptbuffer;
+        tokenbuf_t scan;
+        memset(&scan, 0, sizeof(scan));
+        while (parse_token(&cursor, &scan, true))
+        {
+            if ((!strcmp(scan.text, "$load") || !strcmp(scan.text, "$framefile")) && parse_token(&cursor, &scan, false))
+                add_palette_source(&build, scan.text);
+        }
+        if (scan.unterminated)
+            error("EOF inside quoted token");
+        free(scan.text);
+        end_script_parse();
+    }
+    t_scan = now_seconds();
+
+    if (!build.numimages)
+        error("No images to build a palette from");
+
+    build.histograms = safe_malloc((numworkers + 1) * sizeof(histogram_t));
+    parallel_for(build.numimages, histogram_images, &build);
+    t_histogram = now_seconds();
+
+    /* reduce the per-thread histograms into the first one */
+    histogram_t *merged = &build.histograms[0];
+    int shift = 0;
+    for (int i = 0; i < build.numhistograms; i++)
+    {
+        if (build.histograms[i].shift > shift)
+            shift = build.histograms[i].shift;
+    }
+    if (merged->shift < shift)
+        histogram_rehash(merged, shift, merged->size);
+
+    /* the merged table obeys the same cap, and may coarsen past every source */
+    for (int i = 1; i < build.numhistograms; i++)
+    {
+        histogram_t *hist = &build.histograms[i];
+
+        for (size_t j = 0; j < hist->size; j++)
+        {
+            if (!hist->bins[j].key)
+                continue;
+            histogram_insert(merged, coarsen_key(hist->bins[j].key, merged->shift - hist->shift), &hist->bins[j]);
+            histogram_grow(merged);
+        }
+        free(hist->bins);
+    }
+    t_merge = now_seconds();
+
+    colorpoint_t *points = safe_malloc((merged->used ? merged->used : 1) * sizeof(colorpoint_t));
+    int numpoints = 0;
+    for (size_t i = 0; i < merged->size; i++)
+    {
+        const colorbin_t *bin = &merged->bins[i];
+        if (!bin->key)
+            continue;
+
+        colorpoint_t *point = &points[numpoints++];
+        point->count = bin->count;
+        for (int c = 0; c < 3; c++)
+        {
+            point->sum[c] = bin->sum[c];
+            point->rgb[c] = (byte)((bin->sum[c] + bin->count / 2) / bin->count);
+        }
+    }
+
+    /* hash order depends on table history; sort so the result does not */
+    compare_points_axis = 0;
+    qsort(points, numpoints, sizeof(colorpoint_t), compare_points);
 
-    printf("sprgen: successful\n");
-    printf("%d frame(s)\n", framecount);
-    printf("%d ungrouped frame(s), including group headers\n", sprite.numframes);
+    byte palette[PALETTE_SIZE * 3];
+    median_cut(points, numpoints, palette);
+    t_quantize = now_seconds();
+
+    FILE *f = safe_open_write(outname);
+    safe_write(f, palette, PALETTE_FILE_SIZE);
+    fclose(f);
+    t_write = now_seconds();
+
+    fprintf(msgout, "palette: %d image(s), %llu pixel(s), %d distinct bin(s) at %d bit(s) per channel\n",
+            build.numimages, (unsigned long long)build.pixels, numpoints, 8 - merged->shift);
+    fprintf(msgout, "  scan       %.3f s\n", t_scan - start);
+    fprintf(msgout, "  histogram  %.3f s (%d thread(s))\n", t_histogram - t_scan, build.numhistograms);
+    fprintf(msgout, "  merge      %.3f s\n", t_merge - t_histogram);
+    fprintf(msgout, "  quantize   %.3f s\n", t_quantize - t_merge);
+    fprintf(msgout, "  write      %.3f s\n", t_write - t_quantize);
+    fprintf(msgout, "wrote %s\n", outname);
+
+    free(points);
+    free(merged->bins);
+    free(build.histograms);
+    for (int i = 0; i < build.numimages; i++)
+    {
+        free(build.names[i]);
+        free(build.paths[i]);
+    }
+    free(build.names);
+    free(build.paths);
+    pthread_mutex_destroy(&build.lock);
 }
 
 static void parse_script(void)
@@ -817,6 +4128,11 @@ static void parse_script(void)
             if (framecount > 0)
                 finish_sprite();
 
+            /* the previous sprite is written; its frames are no longer needed */
+            plump = lumpbuffer;
+            store_raw_bytes = 0;
+            quality_sprite_frames = 0;
+
             get_token(false);
             if (spriteoutname)
                 free(spriteoutname);
@@ -835,6 +4151,7 @@ static void parse_script(void)
             }
 
             memset(&sprite, 0, sizeof(sprite));
+            free_variants();
             framecount = 0;
             palette_established = false;
             framesmaxs[0] = -9999999;
@@ -847,33 +4164,19 @@ static void parse_script(void)
         else if (!strcmp(token, "$type"))
         {
             get_token(false);
-            if (!strcmp(token, "vp_parallel_upright"))
-                sprite.type = SPR_VP_PARALLEL_UPRIGHT;
-            else if (!strcmp(token, "facing_upright"))
-                sprite.type = SPR_FACING_UPRIGHT;
-            else if (!strcmp(token, "vp_parallel"))
-                sprite.type = SPR_VP_PARALLEL;
-            else if (!strcmp(token, "oriented"))
-                sprite.type = SPR_ORIENTED;
-            else if (!strcmp(token, "vp_parallel_oriented"))
-                sprite.type = SPR_VP_PARALLEL_ORIENTED;
-            else
+            if (!lookup_type(token, &sprite.type))
                 error("Bad type: %s", token);
         }
         else if (!strcmp(token, "$texture"))
         {
             get_token(false);
-            if (!strcmp(token, "normal"))
-                sprite.texFormat = SPR_NORMAL;
-            else if (!strcmp(token, "additive"))
-                sprite.texFormat = SPR_ADDITIVE;
-            else if (!strcmp(token, "indexalpha"))
-                sprite.texFormat = SPR_INDEXALPHA;
-            else if (!strcmp(token, "alphatest"))
-                sprite.texFormat = SPR_ALPHTEST;
-            else
+            if (!lookup_texformat(token, &sprite.texFormat))
                 error("Bad texture format: %s", token);
         }
+        else if (!strcmp(token, "$variant"))
+        {
+            add_variant();
+        }
         else if (!strcmp(token, "$beamlength"))
         {
             get_token(false);
@@ -888,13 +4191,29 @@ static void parse_script(void)
             get_token(false);
             load_bmp(token);
         }
+        else if (!strcmp(token, "$palette"))
+        {
+            get_token(false);
+            char *palettepath = resolve_path(token);
+            set_fixed_palette(palettepath);
+            free(palettepath);
+        }
         else if (!strcmp(token, "$frame"))
         {
             grab_frame();
             sprite.numframes++;
         }
+        else if (!strcmp(token, "$grid"))
+        {
+            sprite.numframes += grab_grid();
+        }
+        else if (!strcmp(token, "$framefile"))
+        {
+            sprite.numframes += grab_framefiles();
+        }
         else if (!strcmp(token, "$groupstart"))
         {
+            ensure_frame_capacity(1);
             int groupframe = framecount++;
             frames[groupframe].type = SPR_GROUP;
             frames[groupframe].numgroupframes = 0;
@@ -906,6 +4225,14 @@ static void parse_script(void)
                     grab_frame();
                     frames[groupframe].numgroupframes++;
                 }
+                else if (!strcmp(token, "$grid"))
+                {
+                    frames[groupframe].numgroupframes += grab_grid();
+                }
+                else if (!strcmp(token, "$framefile"))
+                {
+                    frames[groupframe].numgroupframes += grab_framefiles();
+                }
                 else if (!strcmp(token, "$load"))
                 {
                     get_token(false);
@@ -917,7 +4244,7 @@ static void parse_script(void)
                 }
                 else
                 {
-                    error("$frame, $load, or $groupend expected");
+                    error("$frame, $grid, $framefile, $load, or $groupend expected");
                 }
             }
 
@@ -937,8 +4264,11 @@ int main(int argc, char **argv)
 {
     int i;
     char *filename = NULL;
-
-    printf("sprgen\n");
+    const char *palettename = NULL;
+    const char *basedir = NULL;
+    const char *buildpalettename = NULL;
+    char **inputs = safe_malloc(argc * sizeof(char *));
+    int numinputs = 0;
 
     for (i = 1; i < argc; i++)
     {
@@ -960,23 +4290,117 @@ int main(int argc, char **argv)
             cli_output_name = safe_malloc(strlen(argv[i]) + 1);
             strcpy(cli_output_name, argv[i]);
         }
+        else if (!strcmp(argv[i], "--base-dir"))
+        {
+            if (i + 1 >= argc)
+                error("Option %s requires a value", argv[i]);
+            basedir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--source-archive"))
+        {
+            if (i + 1 >= argc)
+                error("Option %s requires a value", argv[i]);
+            mount_archive(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--palette"))
+        {
+            if (i + 1 >= argc)
+                error("Option %s requires a value", argv[i]);
+            palettename = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--build-palette"))
+        {
+            if (i + 1 >= argc)
+                error("Option %s requires a value", argv[i]);
+            buildpalettename = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--alpha-threshold"))
+        {
+            if (i + 1 >= argc)
+                error("Option %s requires a value", argv[i]);
+            char *end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end || end == argv[i] || value < 0 || value > 256)
+                error("Bad alpha threshold: %s", argv[i]);
+            alpha_threshold = (int)value;
+        }
+        else if (!strcmp(argv[i], "--dither"))
+        {
+            if (i + 1 >= argc)
+                error("Option %s requires a value", argv[i]);
+            i++;
+            if (!strcmp(argv[i], "none"))
+                dither_mode = DITHER_NONE;
+            else if (!strcmp(argv[i], "ordered"))
+                dither_mode = DITHER_ORDERED;
+            else if (!strcmp(argv[i], "fs"))
+                dither_mode = DITHER_FS;
+            else
+                error("Bad dither mode: %s", argv[i]);
+        }
+        else if (!strcmp(argv[i], "--threads"))
+        {
+            if (i + 1 >= argc)
+                error("Option %s requires a value", argv[i]);
+            requested_threads = atoi(argv[++i]);
+            if (requested_threads <= 0)
+                error("Bad thread count: %s", argv[i]);
+        }
+        else if (!strcmp(argv[i], "--quality-report"))
+        {
+            if (i + 1 >= argc)
+                error("Option %s requires a value", argv[i]);
+            quality_report_name = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--plan"))
+        {
+            plan_mode = true;
+        }
+        else if (!strcmp(argv[i], "--compact-frames"))
+        {
+            compact_frames = true;
+        }
+        else if (!strcmp(argv[i], "--no-prefetch"))
+        {
+            prefetch_enabled = false;
+        }
         else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-help"))
         {
-            printf("Usage: %s [options] file.qc\n", argv[0]);
+            printf("Usage: %s [options] file.qc|-\n", argv[0]);
+            printf("       %s --build-palette out.pal [options] file.qc|file.bmp...\n", argv[0]);
             printf("Options:\n");
             printf("  -16bit          Enable 16-bit mode (default)\n");
             printf("  -no16bit        Disable 16-bit mode\n");
-            printf("  -o, --output    Override output sprite file path\n");
+            printf("  -o, --output    Override output sprite file path (- for stdout)\n");
+            printf("  --base-dir DIR  Resolve relative paths in the script against DIR\n");
+            printf("  --source-archive FILE\n");
+            printf("                  Mount a tar or stored zip archive for $load/$framefile (repeatable)\n");
+            printf("  --palette FILE  Use a fixed palette (.pal/.lmp or paletted BMP) for all sprites\n");
+            printf("  --alpha-threshold N\n");
+            printf("                  alphatest: 32-bit pixels with alpha below N use index 255 (default 128)\n");
+            printf("  --dither MODE   Dither truecolor images: none (default), ordered or fs\n");
+            printf("  --build-palette FILE\n");
+            printf("                  Build one palette for all given scripts and BMPs, write it and exit\n");
+            printf("  --threads N     Number of worker threads (default: CPU count)\n");
+            printf("  --plan          Check the script and print the sprite layout and size as JSON,\n");
+            printf("                  reading only BMP headers; nothing is written\n");
+            printf("  --quality-report FILE\n");
+            printf("                  Write per-sheet and per-frame quantization error as JSON (- for stdout)\n");
+            printf("  --compact-frames\n");
+            printf("                  Keep cut frames run-length packed in memory until they are written\n");
+            printf("  --no-prefetch   Read $load images one at a time instead of ahead of use, and\n");
+            printf("                  start no worker threads unless --threads is given\n");
             printf("  --help          Show this help\n");
             return 0;
         }
-        else if (argv[i][0] == '-')
+        else if (argv[i][0] == '-' && argv[i][1])
         {
             error("Unknown option: %s", argv[i]);
         }
         else
         {
             filename = argv[i];
+            inputs[numinputs++] = argv[i];
         }
     }
 
@@ -985,47 +4409,123 @@ int main(int argc, char **argv)
         error("No input file specified");
     }
 
+    /* keep stdout clean when it carries the sprite or the report */
+    msgout = stdout;
+    if (cli_output_name && !strcmp(cli_output_name, "-"))
+    {
+        if (quality_report_name && !strcmp(quality_report_name, "-"))
+            error("The sprite and the quality report cannot both go to stdout");
+        msgout = stderr;
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    else if (quality_report_name && !strcmp(quality_report_name, "-"))
+    {
+        msgout = stderr;
+    }
+
+    /* a plan owns stdout and touches no pixels, so pixel options do not apply */
+    if (plan_mode)
+    {
+        msgout = stderr;
+        prefetch_enabled = false;
+        compact_frames = false;
+        quality_report_name = NULL;
+    }
+
+    fprintf(msgout, "sprgen\n");
+
+    if (buildpalettename)
+    {
+        start_workers(requested_threads ? requested_threads : cpu_count());
+        build_palette(buildpalettename, inputs, numinputs, basedir);
+        stop_workers();
+        if (numarchives)
+            unmount_archives();
+        free(spritedir);
+        free(inputs);
+        return 0;
+    }
+
     lumpbuffer = safe_malloc(buffer_size);
     plump = lumpbuffer;
     frames = safe_malloc(max_frames * sizeof(spritepackage_t));
 
-    spritedir = safe_malloc(MAX_PATH_SIZE);
-    strcpy(spritedir, filename);
-    int slash_index = -1;
-    for (int j = (int)strlen(spritedir) - 1; j >= 0; j--)
-    {
-        if (spritedir[j] == '/' || spritedir[j] == '\\')
-        {
-            spritedir[j + 1] = 0;
-            slash_index = j;
-            break;
-        }
-    }
-    if (slash_index < 0)
-        strcpy(spritedir, "./");
+    spritedir = script_dir(filename, basedir);
+
+    if (palettename)
+        set_fixed_palette(palettename);
 
     sprite.synctype = ST_RAND;
     sprite.type = SPR_VP_PARALLEL_UPRIGHT;
     sprite.texFormat = SPR_NORMAL;
     sprite.beamlength = 0;
 
+    /* without prefetch, run single-threaded as before unless threads were asked for */
+    if (prefetch_enabled || requested_threads)
+        start_workers(requested_threads ? requested_threads : cpu_count());
+
+    if (plan_mode)
+    {
+        printf("{\"script\": ");
+        json_string(stdout, filename);
+        printf(", \"sprites\": [");
+    }
+
     start_script_parse(filename);
+    prefetchptr = scriptbuffer;
     parse_script();
+    prefetch_drain();
     end_script_parse();
 
+    stop_workers();
+
+    if (numarchives)
+    {
+        fprintf(msgout, "vfs: %d archive hit(s), %d disk read(s), %zu bytes from archives, %zu bytes mapped\n",
+                vfs_hits, vfs_disk_reads, vfs_bytes_read, vfs_bytes_mapped);
+        unmount_archives();
+    }
+
     if (framecount > 0)
         finish_sprite();
 
+    if (plan_mode)
+        printf("%s]}\n", plan_sprites ? "\n  " : "");
+
+    if (quality_report_name)
+        write_quality_report();
+
+    if (compact_frames)
+        fprintf(msgout, "frame store peak: %zu bytes instead of %zu, %lld saved\n",
+                store_peak_packed, store_peak_raw, (long long)store_peak_raw - (long long)store_peak_packed);
+
     free(lumpbuffer);
+    free(outbuffer);
     free(frames);
     free(spritedir);
     free(spriteoutname);
     free(byteimage);
     free(lbmpalette);
     free(original_palette);
-    free(token);
+    free(fixed_palette);
+    free_variants();
+    free(variants);
+    for (i = 0; i < numqualitysheets; i++)
+        free(qualitysheets[i].name);
+    for (i = 0; i < numqualityframes; i++)
+        free(qualityframes[i].sprite);
+    free(qualitysheets);
+    free(qualityframes);
+    free(qualitypixels);
+    free(colorlookup.cellstart);
+    free(colorlookup.candidates);
+    free(scripttoken.text);
+    free(prefetchtoken.text);
     if (cli_output_name)
         free(cli_output_name);
+    free(inputs);
 
     return 0;
 }
@@ -1,53 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include "sprread.h"
 
-#define IDSPRITEHEADER (('P' << 24) + ('S' << 16) + ('D' << 8) + 'I')
-
-typedef struct
+static void print_frame(const spr_file_t *spr, int index, const char *indent)
 {
-    int32_t ident;
-    int32_t version;
-    int32_t type;
-    int32_t texFormat;
-    float boundingradius;
-    int32_t width;
-    int32_t height;
-    int32_t numframes;
-    float beamlength;
-    int32_t synctype;
-} dsprite_t;
-
-int main(int argc, char *argv[])
-{
-    if (argc != 2)
-    {
-        printf("Usage: %s <sprite.spr>\n", argv[0]);
-        return 1;
-    }
-
-    FILE *f = fopen(argv[1], "rb");
-    if (!f)
-    {
-        printf("Error: Cannot open %s\n", argv[1]);
-        return 1;
-    }
+    spr_frame_t frame = spr_frame(spr, index);
 
-    dsprite_t header;
-    if (fread(&header, sizeof(header), 1, f) != 1)
-    {
-        printf("Error: Cannot read sprite header\n");
-        fclose(f);
-        return 1;
-    }
+    printf("%sFrame %d: %dx%d, origin (%d, %d)\n", indent, index,
+           frame.width, frame.height, frame.origin[0], frame.origin[1]);
+}
 
-    printf("Sprite Information for: %s\n", argv[1]);
+static void print_header(const char *path, const spr_header_t *header)
+{
+    printf("Sprite Information for: %s\n", path);
     printf("================================\n");
-    printf("Magic: 0x%08X (%s)\n", header.ident,
-           header.ident == IDSPRITEHEADER ? "Valid" : "INVALID");
-    printf("Version: %d\n", header.version);
-    printf("Type: %d ", header.type);
-    switch (header.type)
+    printf("Magic: 0x%08X (%s)\n", (unsigned)header->ident,
+           header->ident == SPR_IDENT ? "Valid" : "INVALID");
+    printf("Version: %d\n", header->version);
+    printf("Type: %d ", header->type);
+    switch (header->type)
     {
     case 0:
         printf("(vp_parallel_upright)\n");
@@ -68,8 +40,8 @@ int main(int argc, char *argv[])
         printf("(unknown)\n");
         break;
     }
-    printf("Texture Format: %d ", header.texFormat);
-    switch (header.texFormat)
+    printf("Texture Format: %d ", header->texformat);
+    switch (header->texformat)
     {
     case 0:
         printf("(normal)\n");
@@ -87,22 +59,65 @@ int main(int argc, char *argv[])
         printf("(unknown)\n");
         break;
     }
-    printf("Bounding Radius: %.2f\n", header.boundingradius);
-    printf("Dimensions: %dx%d\n", header.width, header.height);
-    printf("Frame Count: %d\n", header.numframes);
-    printf("Beam Length: %.2f\n", header.beamlength);
-    printf("Sync Type: %d (%s)\n", header.synctype,
-           header.synctype == 0 ? "synchronized" : "random");
+    printf("Bounding Radius: %.2f\n", header->boundingradius);
+    printf("Dimensions: %dx%d\n", header->width, header->height);
+    printf("Frame Count: %d\n", header->numframes);
+    printf("Beam Length: %.2f\n", header->beamlength);
+    printf("Sync Type: %d (%s)\n", header->synctype,
+           header->synctype == 0 ? "synchronized" : "random");
+}
 
-    if (header.texFormat == 0)
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        printf("Usage: %s <sprite.spr>\n", argv[0]);
+        return 1;
+    }
+
+    spr_file_t spr;
+    int result = spr_open(&spr, argv[1]);
+    if (result != SPR_OK)
     {
-        int16_t palette_size;
-        if (fread(&palette_size, sizeof(palette_size), 1, f) == 1)
+        /* show what a broken file's header claims before saying what is wrong */
+        spr_header_t header;
+        if (spr_read_header(&header, argv[1]) != SPR_OK)
+        {
+            printf("Error: Cannot read %s: %s\n", argv[1], spr_strerror(result));
+            return 1;
+        }
+        print_header(argv[1], &header);
+        printf("Error: %s\n", spr_strerror(result));
+        return 1;
+    }
+
+    print_header(argv[1], &spr.header);
+    if (spr.palette)
+        printf("Palette Size: %d colors\n", spr.palettecolors);
+    else
+        printf("Palette Size: none\n");
+
+    printf("Layout: %d entr%s, %d frame(s), %zu bytes\n", spr.numentries,
+           spr.numentries == 1 ? "y" : "ies", spr.numframes, spr.size);
+
+    for (int i = 0; i < spr.numentries; i++)
+    {
+        const spr_entry_t *entry = &spr.entries[i];
+
+        if (entry->type == SPR_SINGLE)
+        {
+            print_frame(&spr, entry->firstframe, "  ");
+            continue;
+        }
+
+        printf("  Group of %d frame(s):\n", entry->numframes);
+        for (int j = 0; j < entry->numframes; j++)
         {
-            printf("Palette Size: %d colors\n", palette_size);
+            print_frame(&spr, entry->firstframe + j, "    ");
+            printf("      ends at %.3f\n", spr_group_interval(&spr, i, j));
         }
     }
 
-    fclose(f);
+    spr_close(&spr);
     return 0;
 }
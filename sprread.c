@@ -0,0 +1,445 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sprread.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define HEADER_SIZE_V1 36
+#define HEADER_SIZE_V2 40
+#define FRAME_HEADER_SIZE 16
+
+static int32_t read_le32(const uint8_t *p)
+{
+    return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static int read_le16(const uint8_t *p)
+{
+    return (int16_t)(p[0] | (p[1] << 8));
+}
+
+static float read_lefloat(const uint8_t *p)
+{
+    union
+    {
+        uint32_t i;
+        float f;
+    } u;
+    u.i = (uint32_t)read_le32(p);
+    return u.f;
+}
+
+static int map_file(const char *path, int writable, const uint8_t **data, size_t *size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                              FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return SPR_ERR_OPEN;
+
+    LARGE_INTEGER length;
+    if (!GetFileSizeEx(file, &length))
+    {
+        CloseHandle(file);
+        return SPR_ERR_OPEN;
+    }
+    if (length.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return SPR_ERR_TRUNCATED;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return SPR_ERR_MAP;
+
+    void *view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view)
+        return SPR_ERR_MAP;
+
+    *data = view;
+    *size = (size_t)length.QuadPart;
+    return SPR_OK;
+#else
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return SPR_ERR_OPEN;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return SPR_ERR_OPEN;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return SPR_ERR_TRUNCATED;
+    }
+
+    void *view = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                      writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+        return SPR_ERR_MAP;
+
+    *data = view;
+    *size = st.st_size;
+    return SPR_OK;
+#endif
+}
+
+static void unmap_file(const uint8_t *data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile((void *)data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+static int add_frame(spr_file_t *spr, int *maxframes, size_t offset, int entry)
+{
+    if (spr->numframes == *maxframes)
+    {
+        int newmax = *maxframes ? *maxframes * 2 : 64;
+        size_t *offsets = realloc(spr->frameoffsets, newmax * sizeof(size_t));
+        if (!offsets)
+            return SPR_ERR_NOMEM;
+        spr->frameoffsets = offsets;
+
+        int32_t *entries = realloc(spr->frameentry, newmax * sizeof(int32_t));
+        if (!entries)
+            return SPR_ERR_NOMEM;
+        spr->frameentry = entries;
+
+        *maxframes = newmax;
+    }
+
+    spr->frameoffsets[spr->numframes] = offset;
+    spr->frameentry[spr->numframes] = entry;
+    spr->numframes++;
+    return SPR_OK;
+}
+
+/* Checks the frame header at *pos and steps over it and its pixels. */
+static int skip_frame(const spr_file_t *spr, size_t *pos)
+{
+    if (spr->size - *pos < FRAME_HEADER_SIZE)
+        return SPR_ERR_TRUNCATED;
+
+    int32_t width = read_le32(spr->data + *pos + 8);
+    int32_t height = read_le32(spr->data + *pos + 12);
+    if (width <= 0 || height <= 0)
+        return SPR_ERR_FORMAT;
+
+    uint64_t pixels = (uint64_t)width * (uint64_t)height;
+    if (pixels > spr->size - *pos - FRAME_HEADER_SIZE)
+        return SPR_ERR_TRUNCATED;
+
+    *pos += FRAME_HEADER_SIZE + (size_t)pixels;
+    return SPR_OK;
+}
+
+/* Walks the whole file once, filling the entry and frame offset tables. */
+static int build_index(spr_file_t *spr, int withpalette, size_t *end)
+{
+    const uint8_t *data = spr->data;
+    size_t size = spr->size;
+    size_t pos;
+    int maxframes = 0;
+    int result;
+
+    spr->palette = NULL;
+    spr->palettecolors = 0;
+    spr->numentries = 0;
+    spr->numframes = 0;
+
+    if (spr->header.version == 1)
+    {
+        pos = HEADER_SIZE_V1;
+    }
+    else
+    {
+        pos = HEADER_SIZE_V2;
+        if (withpalette)
+        {
+            if (size - pos < 2)
+                return SPR_ERR_TRUNCATED;
+            int colors = read_le16(data + pos);
+            if (colors <= 0 || colors > 256)
+                return SPR_ERR_FORMAT;
+            pos += 2;
+            if (size - pos < (size_t)colors * 3)
+                return SPR_ERR_TRUNCATED;
+            spr->palette = data + pos;
+            spr->palettecolors = colors;
+            pos += (size_t)colors * 3;
+        }
+    }
+
+    for (int i = 0; i < spr->header.numframes; i++)
+    {
+        spr_entry_t *entry = &spr->entries[i];
+
+        if (size - pos < 4)
+            return SPR_ERR_TRUNCATED;
+        entry->type = read_le32(data + pos);
+        entry->firstframe = spr->numframes;
+        entry->intervals = 0;
+        pos += 4;
+
+        if (entry->type == SPR_SINGLE)
+        {
+            entry->numframes = 1;
+            if ((result = add_frame(spr, &maxframes, pos, i)) != SPR_OK)
+                return result;
+            if ((result = skip_frame(spr, &pos)) != SPR_OK)
+                return result;
+        }
+        else if (entry->type == SPR_GROUP || entry->type == SPR_ANGLED)
+        {
+            if (size - pos < 4)
+                return SPR_ERR_TRUNCATED;
+            int32_t count = read_le32(data + pos);
+            pos += 4;
+            if (count <= 0)
+                return SPR_ERR_FORMAT;
+            if ((uint64_t)count * (4 + FRAME_HEADER_SIZE + 1) > size - pos)
+                return SPR_ERR_TRUNCATED;
+
+            entry->numframes = count;
+            entry->intervals = pos;
+            pos += (size_t)count * 4;
+
+            for (int j = 0; j < count; j++)
+            {
+                if ((result = add_frame(spr, &maxframes, pos, i)) != SPR_OK)
+                    return result;
+                if ((result = skip_frame(spr, &pos)) != SPR_OK)
+                    return result;
+            }
+        }
+        else
+        {
+            return SPR_ERR_FORMAT;
+        }
+
+        spr->numentries++;
+    }
+
+    *end = pos;
+    return SPR_OK;
+}
+
+/*
+ * Decodes the header fields without judging them. Version 1 has the short
+ * layout; any other version is read with the Half-Life one.
+ */
+static int decode_header(const uint8_t *data, size_t size, spr_header_t *header)
+{
+    if (size < HEADER_SIZE_V1)
+        return SPR_ERR_TRUNCATED;
+
+    header->ident = read_le32(data);
+    header->version = read_le32(data + 4);
+
+    if (header->version == 1)
+    {
+        header->type = read_le32(data + 8);
+        header->texformat = 0;
+        header->boundingradius = read_lefloat(data + 12);
+        header->width = read_le32(data + 16);
+        header->height = read_le32(data + 20);
+        header->numframes = read_le32(data + 24);
+        header->beamlength = read_lefloat(data + 28);
+        header->synctype = read_le32(data + 32);
+    }
+    else
+    {
+        if (size < HEADER_SIZE_V2)
+            return SPR_ERR_TRUNCATED;
+        header->type = read_le32(data + 8);
+        header->texformat = read_le32(data + 12);
+        header->boundingradius = read_lefloat(data + 16);
+        header->width = read_le32(data + 20);
+        header->height = read_le32(data + 24);
+        header->numframes = read_le32(data + 28);
+        header->beamlength = read_lefloat(data + 32);
+        header->synctype = read_le32(data + 36);
+    }
+
+    return SPR_OK;
+}
+
+static int parse(spr_file_t *spr)
+{
+    const uint8_t *data = spr->data;
+    spr_header_t *header = &spr->header;
+
+    if (spr->size < HEADER_SIZE_V1)
+        return SPR_ERR_TRUNCATED;
+
+    int32_t version = read_le32(data + 4);
+    if (read_le32(data) != SPR_IDENT || (version != 1 && version != 2))
+        return SPR_ERR_FORMAT;
+
+    int result = decode_header(data, spr->size, header);
+    if (result != SPR_OK)
+        return result;
+
+    /* every entry needs at least a type word and a frame header */
+    if (header->numframes <= 0 || (uint64_t)header->numframes * (4 + FRAME_HEADER_SIZE) > spr->size)
+        return SPR_ERR_FORMAT;
+
+    spr->entries = malloc(header->numframes * sizeof(spr_entry_t));
+    if (!spr->entries)
+        return SPR_ERR_NOMEM;
+
+    size_t end = 0;
+    result = build_index(spr, 1, &end);
+    if (header->version == 1 || (result == SPR_OK && end == spr->size))
+        return result;
+
+    /*
+     * sprgen -no16bit writes version 2 headers without a palette; accept
+     * that layout when it accounts for the file exactly.
+     */
+    size_t altend = 0;
+    int palettedresult = result;
+    if (build_index(spr, 0, &altend) == SPR_OK && altend == spr->size)
+        return SPR_OK;
+
+    if (palettedresult == SPR_OK)
+        return build_index(spr, 1, &end);
+    return palettedresult;
+}
+
+int spr_open_memory(spr_file_t *spr, const void *data, size_t size)
+{
+    memset(spr, 0, sizeof(*spr));
+    spr->data = data;
+    spr->size = size;
+
+    int result = parse(spr);
+    if (result != SPR_OK)
+        spr_close(spr);
+    return result;
+}
+
+static int open_mapped(spr_file_t *spr, const char *path, int writable)
+{
+    const uint8_t *data;
+    size_t size;
+
+    memset(spr, 0, sizeof(*spr));
+
+    int result = map_file(path, writable, &data, &size);
+    if (result != SPR_OK)
+        return result;
+
+    spr->data = data;
+    spr->size = size;
+    spr->mapped = 1;
+    spr->writable = writable;
+
+    result = parse(spr);
+    if (result != SPR_OK)
+        spr_close(spr);
+    return result;
+}
+
+int spr_read_header(spr_header_t *header, const char *path)
+{
+    uint8_t data[HEADER_SIZE_V2];
+    FILE *f = fopen(path, "rb");
+
+    if (!f)
+        return SPR_ERR_OPEN;
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    return decode_header(data, size, header);
+}
+
+int spr_open(spr_file_t *spr, const char *path)
+{
+    return open_mapped(spr, path, 0);
+}
+
+int spr_open_writable(spr_file_t *spr, const char *path)
+{
+    return open_mapped(spr, path, 1);
+}
+
+uint8_t *spr_writable(const spr_file_t *spr)
+{
+    return spr->writable ? (uint8_t *)spr->data : NULL;
+}
+
+void spr_close(spr_file_t *spr)
+{
+    if (spr->mapped && spr->data)
+        unmap_file(spr->data, spr->size);
+    free(spr->entries);
+    free(spr->frameoffsets);
+    free(spr->frameentry);
+    memset(spr, 0, sizeof(*spr));
+}
+
+const char *spr_strerror(int code)
+{
+    switch (code)
+    {
+    case SPR_OK:
+        return "no error";
+    case SPR_ERR_OPEN:
+        return "cannot open file";
+    case SPR_ERR_MAP:
+        return "cannot map file";
+    case SPR_ERR_FORMAT:
+        return "not a valid sprite";
+    case SPR_ERR_TRUNCATED:
+        return "sprite is truncated";
+    case SPR_ERR_NOMEM:
+        return "out of memory";
+    default:
+        return "unknown error";
+    }
+}
+
+spr_frame_t spr_frame(const spr_file_t *spr, int index)
+{
+    const uint8_t *p = spr->data + spr->frameoffsets[index];
+    spr_frame_t frame;
+
+    frame.origin[0] = read_le32(p);
+    frame.origin[1] = read_le32(p + 4);
+    frame.width = read_le32(p + 8);
+    frame.height = read_le32(p + 12);
+    frame.pixels = p + FRAME_HEADER_SIZE;
+    return frame;
+}
+
+float spr_group_interval(const spr_file_t *spr, int entry, int i)
+{
+    const spr_entry_t *e = &spr->entries[entry];
+
+    if (e->type == SPR_SINGLE)
+        return 0.0f;
+    return read_lefloat(spr->data + e->intervals + (size_t)i * 4);
+}
@@ -0,0 +1,122 @@
+#ifndef SPRREAD_H
+#define SPRREAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal reader for Quake (version 1) and Half-Life (version 2) sprites.
+ *
+ * spr_open maps the file and builds an offset index over every frame and
+ * group in one pass. After that, any frame can be looked up in constant
+ * time, and frame pixels and the palette are pointers into the mapping.
+ * Nothing is copied. Multi-byte fields are stored little-endian and are
+ * decoded byte by byte, so the reader works on any host byte order.
+ */
+
+#define SPR_IDENT (('P' << 24) + ('S' << 16) + ('D' << 8) + 'I')
+
+#define SPR_SINGLE 0
+#define SPR_GROUP 1
+#define SPR_ANGLED 2
+
+/* Half-Life texture formats */
+#define SPR_NORMAL 0
+#define SPR_ADDITIVE 1
+#define SPR_INDEXALPHA 2
+#define SPR_ALPHTEST 3
+
+enum
+{
+    SPR_OK = 0,
+    SPR_ERR_OPEN,
+    SPR_ERR_MAP,
+    SPR_ERR_FORMAT,
+    SPR_ERR_TRUNCATED,
+    SPR_ERR_NOMEM
+};
+
+typedef struct
+{
+    int32_t ident;
+    int32_t version;
+    int32_t type;
+    int32_t texformat;
+    float boundingradius;
+    int32_t width;
+    int32_t height;
+    int32_t numframes;
+    float beamlength;
+    int32_t synctype;
+} spr_header_t;
+
+/* One entry of the top-level frame list: a single frame or a group. */
+typedef struct
+{
+    int32_t type;
+    int32_t firstframe;
+    int32_t numframes;
+    size_t intervals;
+} spr_entry_t;
+
+typedef struct
+{
+    int32_t origin[2];
+    int32_t width;
+    int32_t height;
+    const uint8_t *pixels;
+} spr_frame_t;
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+    spr_header_t header;
+
+    /* NULL when the file carries no palette */
+    const uint8_t *palette;
+    int palettecolors;
+
+    int numentries;
+    spr_entry_t *entries;
+
+    /* every frame, with group members flattened in file order */
+    int numframes;
+    size_t *frameoffsets;
+    int32_t *frameentry;
+
+    int mapped;
+    int writable;
+} spr_file_t;
+
+int spr_open(spr_file_t *spr, const char *path);
+
+/*
+ * Like spr_open, but maps the file shared and writable: stores through
+ * spr_writable() go straight back to the file. Only pixel and palette bytes
+ * should be changed this way; the index is not rebuilt.
+ */
+int spr_open_writable(spr_file_t *spr, const char *path);
+uint8_t *spr_writable(const spr_file_t *spr);
+int spr_open_memory(spr_file_t *spr, const void *data, size_t size);
+void spr_close(spr_file_t *spr);
+
+/*
+ * Reads only the header, without checking the ident or version or looking
+ * past it, so tools can still show what a file that spr_open rejects
+ * claims to be. Fails only when the file cannot be opened or is shorter
+ * than a header.
+ */
+int spr_read_header(spr_header_t *header, const char *path);
+const char *spr_strerror(int code);
+
+/* Frame header and pixels of frame index (0 <= index < numframes). */
+spr_frame_t spr_frame(const spr_file_t *spr, int index);
+
+/*
+ * Cumulative end time of member i of a group entry, as stored in the file.
+ * Single entries have no interval and return 0.
+ */
+float spr_group_interval(const spr_file_t *spr, int entry, int i);
+
+#endif
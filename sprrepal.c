@@ -0,0 +1,313 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "sprread.h"
+#include "sprtool.h"
+
+/*
+ * Rewrites compiled sprites in place for a new palette. Every distinct
+ * source palette gets one old->new index table, built with the same
+ * nearest-color rule sprgen applies to 8-bit sources, and frame pixels are
+ * pushed through that table inside the writable file mapping.
+ *
+ * Alphatest sprites keep index 255 as the transparent key. Indexalpha
+ * indices are coverage values rather than colors, so those sprites only
+ * get the new palette and their pixels are left alone.
+ */
+
+#define PALETTE_SIZE TOOL_PALETTE_SIZE
+#define PALETTE_FILE_SIZE TOOL_PALETTE_FILE_SIZE
+#define TRANSPARENT_INDEX 255
+
+typedef struct
+{
+    uint8_t palette[PALETTE_FILE_SIZE];
+    int colors;
+    bool keyed;
+    uint8_t remap[PALETTE_SIZE];
+    bool identity;
+} remapentry_t;
+
+static uint8_t target_palette[PALETTE_FILE_SIZE];
+static char **paths;
+static int numpaths, maxpaths;
+static bool dry_run;
+
+static remapentry_t *remaps;
+static int numremaps, maxremaps;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t remap_lock = PTHREAD_MUTEX_INITIALIZER;
+static int failures, rewritten, unchanged, skipped;
+static uint64_t pixels_rewritten;
+
+/*
+ * sprgen's rule: an index keeps its value when both palettes hold the same
+ * color there, otherwise it moves to the nearest target color by squared
+ * RGB distance, lowest index on ties. Only the first `colors` target
+ * entries are reachable, since that is all the file stores. Keyed tables
+ * map the key to itself and never pick it for anything else.
+ */
+static void build_remap(remapentry_t *entry)
+{
+    int reachable = entry->colors;
+
+    if (entry->keyed && reachable > TRANSPARENT_INDEX)
+        reachable = TRANSPARENT_INDEX;
+
+    entry->identity = true;
+
+    for (int i = 0; i < entry->colors; i++)
+    {
+        if (entry->keyed && i == TRANSPARENT_INDEX)
+        {
+            entry->remap[i] = i;
+            continue;
+        }
+
+        const uint8_t *c = entry->palette + i * 3;
+
+        if (!memcmp(c, target_palette + i * 3, 3))
+        {
+            entry->remap[i] = i;
+            continue;
+        }
+
+        int best_match = 0;
+        int best_distance = 999999;
+        for (int j = 0; j < reachable; j++)
+        {
+            int dr = c[0] - target_palette[j * 3];
+            int dg = c[1] - target_palette[j * 3 + 1];
+            int db = c[2] - target_palette[j * 3 + 2];
+            int distance = dr * dr + dg * dg + db * db;
+
+            if (distance < best_distance)
+            {
+                best_distance = distance;
+                best_match = j;
+            }
+        }
+
+        entry->remap[i] = best_match;
+        entry->identity = false;
+    }
+
+    for (int i = entry->colors; i < PALETTE_SIZE; i++)
+        entry->remap[i] = i;
+
+    if (memcmp(entry->palette, target_palette, entry->colors * 3))
+        entry->identity = false;
+}
+
+/* Returns the table for a source palette, building it on first sight. */
+static remapentry_t get_remap(const uint8_t *palette, int colors, bool keyed)
+{
+    remapentry_t result;
+
+    pthread_mutex_lock(&remap_lock);
+    for (int i = 0; i < numremaps; i++)
+    {
+        if (remaps[i].colors == colors && remaps[i].keyed == keyed &&
+            !memcmp(remaps[i].palette, palette, colors * 3))
+        {
+            result = remaps[i];
+            pthread_mutex_unlock(&remap_lock);
+            return result;
+        }
+    }
+
+    if (numremaps == maxremaps)
+    {
+        maxremaps = maxremaps ? maxremaps * 2 : 16;
+        remaps = xrealloc(remaps, maxremaps * sizeof(remapentry_t));
+    }
+
+    remapentry_t *entry = &remaps[numremaps++];
+    memset(entry->palette, 0, sizeof(entry->palette));
+    memcpy(entry->palette, palette, colors * 3);
+    entry->colors = colors;
+    entry->keyed = keyed;
+    build_remap(entry);
+    result = *entry;
+    pthread_mutex_unlock(&remap_lock);
+    return result;
+}
+
+/*
+ * Table lookups eight bytes at a time: one 64-bit load and store per group
+ * keeps the loop bound by the table reads rather than by byte traffic.
+ */
+static void remap_pixels(uint8_t *pixels, size_t count, const uint8_t *table)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        uint64_t in, out;
+        memcpy(&in, pixels + i, 8);
+        out = (uint64_t)table[in & 255] |
+              ((uint64_t)table[(in >> 8) & 255] << 8) |
+              ((uint64_t)table[(in >> 16) & 255] << 16) |
+              ((uint64_t)table[(in >> 24) & 255] << 24) |
+              ((uint64_t)table[(in >> 32) & 255] << 32) |
+              ((uint64_t)table[(in >> 40) & 255] << 40) |
+              ((uint64_t)table[(in >> 48) & 255] << 48) |
+              ((uint64_t)table[in >> 56] << 56);
+        memcpy(pixels + i, &out, 8);
+    }
+
+    for (; i < count; i++)
+        pixels[i] = table[pixels[i]];
+}
+
+static void repalette(const char *path)
+{
+    spr_file_t spr;
+    int result = dry_run ? spr_open(&spr, path) : spr_open_writable(&spr, path);
+
+    if (result != SPR_OK)
+    {
+        fprintf(stderr, "Error: %s: %s\n", path, spr_strerror(result));
+        pthread_mutex_lock(&job_lock);
+        failures++;
+        pthread_mutex_unlock(&job_lock);
+        return;
+    }
+
+    if (!spr.palette)
+    {
+        fprintf(stderr, "Warning: %s: no palette to map from, skipped\n", path);
+        pthread_mutex_lock(&job_lock);
+        skipped++;
+        pthread_mutex_unlock(&job_lock);
+        spr_close(&spr);
+        return;
+    }
+
+    remapentry_t remap;
+    bool coverage = spr.header.texformat == SPR_INDEXALPHA;
+    uint64_t count = 0;
+
+    if (coverage)
+    {
+        /* the indices stay; only the tint and preview colors change */
+        remap.identity = !memcmp(spr.palette, target_palette, spr.palettecolors * 3);
+    }
+    else
+    {
+        remap = get_remap(spr.palette, spr.palettecolors, spr.header.texformat == SPR_ALPHTEST);
+    }
+
+    if (!remap.identity)
+    {
+        for (int i = 0; i < spr.numframes && !coverage; i++)
+        {
+            spr_frame_t frame = spr_frame(&spr, i);
+            size_t size = (size_t)frame.width * frame.height;
+
+            if (!dry_run)
+                remap_pixels(spr_writable(&spr) + (frame.pixels - spr.data), size, remap.remap);
+            count += size;
+        }
+
+        if (!dry_run)
+            memcpy(spr_writable(&spr) + (spr.palette - spr.data), target_palette, spr.palettecolors * 3);
+    }
+
+    spr_close(&spr);
+
+    pthread_mutex_lock(&job_lock);
+    if (remap.identity)
+        unchanged++;
+    else
+        rewritten++;
+    pixels_rewritten += count;
+    pthread_mutex_unlock(&job_lock);
+}
+
+static void add_path(const char *path, const char *relative, void *arg)
+{
+    (void)relative;
+    (void)arg;
+
+    if (numpaths == maxpaths)
+    {
+        maxpaths = maxpaths ? maxpaths * 2 : 256;
+        paths = xrealloc(paths, maxpaths * sizeof(char *));
+    }
+    paths[numpaths++] = xstrdup(path);
+}
+
+static void repalette_job(int index, void *arg)
+{
+    (void)arg;
+    repalette(paths[index]);
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 0;
+    const char *palettename = NULL;
+    int first = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--dry-run"))
+        {
+            dry_run = true;
+        }
+        else if (!palettename)
+        {
+            palettename = argv[i];
+        }
+        else
+        {
+            first = i;
+            break;
+        }
+    }
+
+    if (!palettename || !first)
+    {
+        printf("Usage: %s [-j threads] [-n|--dry-run] <palette.pal|palette.bmp> <sprite.spr|directory>...\n", argv[0]);
+        printf("Rewrites sprites in place to use the given palette.\n");
+        return 1;
+    }
+
+    const char *problem = load_palette_file(palettename, target_palette);
+    if (problem)
+    {
+        fprintf(stderr, "Error: %s: %s\n", palettename, problem);
+        return 1;
+    }
+
+    for (int i = first; i < argc; i++)
+        failures += walk_sprites(argv[i], add_path, NULL);
+
+    double start = now_seconds();
+    run_jobs(numpaths, threads, repalette_job, NULL);
+
+    double elapsed = now_seconds() - start;
+
+    printf("sprrepal: %d rewritten, %d already on palette, %d skipped, %d failed%s\n",
+           rewritten, unchanged, skipped, failures, dry_run ? " (dry run)" : "");
+    printf("%d source palette(s), %llu pixel(s) remapped in %.3f s\n",
+           numremaps, (unsigned long long)pixels_rewritten, elapsed);
+
+    for (int i = 0; i < numpaths; i++)
+        free(paths[i]);
+    free(paths);
+    free(remaps);
+
+    return failures ? 1 : 0;
+}
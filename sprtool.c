@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "sprtool.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+void *xmalloc(size_t size)
+{
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size ? size : 1);
+    if (!ptr)
+    {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+char *xstrdup(const char *text)
+{
+    char *copy = xmalloc(strlen(text) + 1);
+    strcpy(copy, text);
+    return copy;
+}
+
+double now_seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+    int n = pthread_num_processors_np();
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n > 0 ? (int)n : 1;
+}
+
+bool is_directory(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool is_sprite_name(const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && (!strcmp(name + length - 4, ".spr") || !strcmp(name + length - 4, ".SPR"));
+}
+
+static int walk_directory(const char *path, const char *relative, sprite_visit_t visit, void *arg)
+{
+    DIR *dir = opendir(path);
+    struct dirent *ent;
+    int problems = 0;
+
+    if (!dir)
+    {
+        fprintf(stderr, "Error: Cannot open directory %s\n", path);
+        return 1;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+
+        char *child = xmalloc(strlen(path) + strlen(ent->d_name) + 2);
+        char *name = xmalloc(strlen(relative) + strlen(ent->d_name) + 2);
+        sprintf(child, "%s/%s", path, ent->d_name);
+        sprintf(name, "%s%s%s", relative, relative[0] ? "/" : "", ent->d_name);
+
+        if (is_directory(child))
+            problems += walk_directory(child, name, visit, arg);
+        else if (is_sprite_name(ent->d_name))
+            visit(child, name, arg);
+
+        free(child);
+        free(name);
+    }
+    closedir(dir);
+    return problems;
+}
+
+int walk_sprites(const char *path, sprite_visit_t visit, void *arg)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+    {
+        fprintf(stderr, "Error: Cannot stat %s\n", path);
+        return 1;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        visit(path, path, arg);
+        return 0;
+    }
+
+    return walk_directory(path, "", visit, arg);
+}
+
+typedef struct
+{
+    int count;
+    int next;
+    void (*job)(int index, void *arg);
+    void *arg;
+    pthread_mutex_t lock;
+} jobqueue_t;
+
+static void *job_worker(void *arg)
+{
+    jobqueue_t *queue = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next < queue->count ? queue->next++ : -1;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index < 0)
+            return NULL;
+
+        queue->job(index, queue->arg);
+    }
+}
+
+void run_jobs(int count, int threads, void (*job)(int index, void *arg), void *arg)
+{
+    jobqueue_t queue;
+
+    queue.count = count;
+    queue.next = 0;
+    queue.job = job;
+    queue.arg = arg;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    if (threads <= 0)
+        threads = cpu_count();
+    if (threads > count)
+        threads = count;
+
+    if (threads <= 1)
+    {
+        job_worker(&queue);
+    }
+    else
+    {
+        pthread_t *workers = xmalloc(threads * sizeof(pthread_t));
+        int started = 0;
+        for (; started < threads; started++)
+        {
+            if (pthread_create(&workers[started], NULL, job_worker, &queue))
+                break;
+        }
+        if (!started)
+            job_worker(&queue);
+        for (int i = 0; i < started; i++)
+            pthread_join(workers[i], NULL);
+        free(workers);
+    }
+
+    pthread_mutex_destroy(&queue.lock);
+}
+
+static int read_le(const uint8_t *p, int bytes)
+{
+    int value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+const char *load_palette_file(const char *filename, uint8_t *palette)
+{
+    FILE *f = fopen(filename, "rb");
+    uint8_t header[54];
+    const char *problem = NULL;
+
+    if (!f)
+        return strerror(errno);
+
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    memset(palette, 0, TOOL_PALETTE_FILE_SIZE);
+
+    if (length >= 54 && fread(header, 1, 54, f) == 54 && header[0] == 'B' && header[1] == 'M')
+    {
+        int header_size = read_le(header + 14, 4);
+        int bpp = read_le(header + 28, 2);
+        int colors_used = read_le(header + 46, 4);
+
+        if (bpp > 8)
+        {
+            problem = "BMP has no color table to take a palette from";
+        }
+        else
+        {
+            int colors = colors_used ? colors_used : 1 << bpp;
+            if (colors > TOOL_PALETTE_SIZE)
+                colors = TOOL_PALETTE_SIZE;
+
+            fseek(f, 14 + header_size, SEEK_SET);
+            for (int i = 0; i < colors; i++)
+            {
+                uint8_t bgra[4];
+                if (fread(bgra, 1, 4, f) != 4)
+                {
+                    problem = "truncated BMP color table";
+                    break;
+                }
+                palette[i * 3] = bgra[2];
+                palette[i * 3 + 1] = bgra[1];
+                palette[i * 3 + 2] = bgra[0];
+            }
+        }
+    }
+    else if (length == TOOL_PALETTE_FILE_SIZE)
+    {
+        fseek(f, 0, SEEK_SET);
+        if (fread(palette, 1, TOOL_PALETTE_FILE_SIZE, f) != TOOL_PALETTE_FILE_SIZE)
+            problem = "file read failure";
+    }
+    else
+    {
+        problem = "not a 768 byte palette or a paletted BMP";
+    }
+
+    fclose(f);
+    return problem;
+}
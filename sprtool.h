@@ -0,0 +1,54 @@
+#ifndef SPRTOOL_H
+#define SPRTOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Helpers shared by the command line tools: allocation that exits on
+ * failure, timing, the sprite directory walk, a simple job pool and the
+ * palette file reader.
+ */
+
+#define TOOL_PALETTE_SIZE 256
+#define TOOL_PALETTE_FILE_SIZE (TOOL_PALETTE_SIZE * 3)
+
+/* Print an error and exit(1) when memory runs out. */
+void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
+char *xstrdup(const char *text);
+
+/* Monotonic seconds, for elapsed-time reports. */
+double now_seconds(void);
+int cpu_count(void);
+
+bool is_directory(const char *path);
+
+/* True for names ending in .spr or .SPR. */
+bool is_sprite_name(const char *name);
+
+/*
+ * Calls visit for path when it is a file, and otherwise for every sprite
+ * below it, recursing into subdirectories. relative is the path below the
+ * starting directory ("sub/a.spr"), or the file's own path when a file was
+ * given. Problems are reported on stderr; returns how many there were.
+ */
+typedef void (*sprite_visit_t)(const char *path, const char *relative, void *arg);
+int walk_sprites(const char *path, sprite_visit_t visit, void *arg);
+
+/*
+ * Runs job(index, arg) for every index in [0, count), handing indices out
+ * in order to up to threads threads (0 for one per CPU). Runs on the
+ * calling thread when only one is needed or none can be started.
+ */
+void run_jobs(int count, int threads, void (*job)(int index, void *arg), void *arg);
+
+/*
+ * Reads a raw 768-byte .pal/.lmp, or the color table of a paletted BMP,
+ * as RGB triples. Entries a BMP does not define are zero. Returns NULL on
+ * success and a description of the problem otherwise.
+ */
+const char *load_palette_file(const char *filename, uint8_t *palette);
+
+#endif